@@ -0,0 +1,505 @@
+/*
+ * Cross-check and benchmark for the chain kernels.
+ *
+ *   gcc -O2 -o bench_chain bench_chain.c chain.c chain_jit.c -lm
+ *   ./bench_chain [--count N]
+ *
+ * First checks that scalar sqroot is the exactly rounded square root, and
+ * that every kernel set this CPU supports matches the scalar one bit for
+ * bit. The operands are around perfect squares and rounding midpoints
+ * across the whole u64 range, powers of two, the neighbourhood of 2^53 and
+ * 2^64, and random values of every width. Compiled chains, both ones the
+ * compiler rewrites and random ones, must match the unfused scalar path on
+ * every kernel set too, as must their native code from chain_jit() where
+ * this CPU can run it, and random chains answered through a
+ * small result cache that keeps overwriting itself. Any mismatch is printed
+ * and fails the run.
+ *
+ * It then times each operation over N operands (default 1M) per kernel
+ * set, and a few chains run stage by stage and compiled. Chains are
+ * written one letter per stage: d double, s square, r sqroot. Last, the
+ * scalar square roots are timed against libm's round(sqrt()) over operand
+ * ranges of u64, with a count of operands libm gets wrong, and chains over
+ * a few thousand repeated operands are timed with and without the cache,
+ * and random chains of 10 to 100 stages fused and as native code.
+ */
+#include "chain.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+void error() {
+  printf("Unable to execute\n");
+  exit(1);
+}
+
+unsigned long lcg_state = 211152;
+
+unsigned long lcg() {
+  lcg_state = lcg_state * 6364136223846793005UL + 1442695040888963407UL;
+  return lcg_state >> 33;
+}
+
+unsigned long rand64() { return lcg() << 62 ^ lcg() << 31 ^ lcg(); }
+
+double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+unsigned long *vals = NULL;
+unsigned long nvals = 0;
+unsigned long cap = 0;
+
+void add(unsigned long x) {
+  if (nvals == cap) {
+    cap = cap ? cap * 2 : 1 << 16;
+    if ((vals = realloc(vals, cap * sizeof(unsigned long))) == NULL)
+      error();
+  }
+  vals[nvals++] = x;
+}
+
+// x and the rounding boundaries around r^2, where sqroot can go wrong.
+void add_square(unsigned long r) {
+  unsigned long sq = r * r;
+  add(sq - 1);
+  add(sq);
+  add(sq + 1);
+  add(sq + r);
+  add(sq + r + 1);
+  add(sq - r);
+  add(sq - r + 1);
+}
+
+void gen_edges() {
+  for (unsigned long r = 0; r < 1 << 16; r++)
+    add_square(r);
+  for (int bit = 16; bit <= 32; bit++)
+    for (long d = -64; d <= 64; d++)
+      add_square((1UL << bit) + d);
+  for (int i = 0; i < 1 << 18; i++)
+    add_square(lcg() & 0xffffffff);
+  for (int bit = 0; bit < 64; bit++)
+    for (long d = -4; d <= 4; d++)
+      add((1UL << bit) + d);
+  for (long d = -1024; d <= 1024; d++)
+    add((1UL << 53) + d);
+  for (unsigned long d = 0; d < 1024; d++)
+    add(~0UL - d);
+  for (int i = 0; i < 1 << 18; i++)
+    add(rand64() >> (lcg() % 64));
+}
+
+// Is r the nearest integer to sqrt(x)? (2r - 1)^2 <= 4x < (2r + 1)^2.
+int sqrt_exact(unsigned long x, unsigned long r) {
+  unsigned __int128 x4 = (unsigned __int128)x * 4;
+  unsigned __int128 lo = r ? (unsigned __int128)(2 * r - 1) * (2 * r - 1) : 0;
+  unsigned __int128 hi = (unsigned __int128)(2 * r + 1) * (2 * r + 1);
+  return lo <= x4 && x4 < hi;
+}
+
+unsigned long sqrt_libm(unsigned long x) { return round(sqrt(x)); }
+
+void check() {
+  for (unsigned long i = 0; i < nvals; i++) {
+    unsigned long r = chain_apply(OP_SQROOT, vals[i]);
+    unsigned long r_int = chain_sqrt_round_int(vals[i]);
+    if (!sqrt_exact(vals[i], r) || r_int != r) {
+      printf("sqroot(%lu) = %lu/%lu is not the nearest integer\n", vals[i],
+             r, r_int);
+      error();
+    }
+  }
+  int chains[][4] = {{OP_DOUBLE}, {OP_SQUARE}, {OP_SQROOT},
+                     {OP_SQUARE, OP_DOUBLE, OP_SQROOT, OP_SQROOT}};
+  int lens[] = {1, 1, 1, 4};
+  unsigned long *want = malloc(nvals * sizeof(unsigned long));
+  unsigned long *got = malloc(nvals * sizeof(unsigned long));
+  if (want == NULL || got == NULL)
+    error();
+  for (int c = 0; c < 4; c++) {
+    memcpy(want, vals, nvals * sizeof(unsigned long));
+    chain_run_isa(CHAIN_SCALAR, chains[c], lens[c], want, nvals);
+    for (int isa = CHAIN_SCALAR + 1; isa <= chain_isa_best(); isa++) {
+      memcpy(got, vals, nvals * sizeof(unsigned long));
+      chain_run_isa(isa, chains[c], lens[c], got, nvals);
+      for (unsigned long i = 0; i < nvals; i++) {
+        if (got[i] != want[i]) {
+          printf("%s: chain %d on %lu gives %lu, scalar %lu\n",
+                 chain_isa_name(isa), c, vals[i], got[i], want[i]);
+          error();
+        }
+      }
+    }
+  }
+  unsigned long libm_off = 0;
+  for (unsigned long i = 0; i < nvals; i++)
+    libm_off += !sqrt_exact(vals[i], sqrt_libm(vals[i]));
+  printf("%lu operands: every kernel set matches the exact scalar path "
+         "(libm is off on %lu)\n",
+         nvals, libm_off);
+  free(want);
+  free(got);
+}
+
+int parse_chain(const char *spec, int *ops) {
+  int n = 0;
+  for (; spec[n] != '\0'; n++)
+    ops[n] = spec[n] == 'd'   ? OP_DOUBLE
+             : spec[n] == 's' ? OP_SQUARE
+                              : OP_SQROOT;
+  return n;
+}
+
+// Run ops over len operands from vals, compiled and not, and compare.
+void check_chain(const int *ops, int nops, unsigned long *want,
+                 unsigned long *got, unsigned long len, int random_pick) {
+  for (unsigned long i = 0; i < len; i++)
+    want[i] = vals[random_pick ? rand64() % nvals : i];
+  memcpy(got, want, len * sizeof(unsigned long));
+  chain_run_isa(CHAIN_SCALAR, ops, nops, want, len);
+  for (int isa = CHAIN_SCALAR; isa <= chain_isa_best(); isa++) {
+    struct chain_prog *prog = chain_compile_isa(isa, ops, nops);
+    if (prog == NULL)
+      error();
+    unsigned long *in = malloc(len * sizeof(unsigned long));
+    if (in == NULL)
+      error();
+    memcpy(in, got, len * sizeof(unsigned long));
+    chain_eval_array(prog, in, len);
+    for (unsigned long i = 0; i < len; i++) {
+      unsigned long one = chain_eval(prog, got[i]);
+      if (in[i] != want[i] || one != want[i]) {
+        printf("%s: compiled chain of %d stages on %lu gives %lu/%lu, "
+               "scalar %lu\n",
+               chain_isa_name(isa), nops, got[i], in[i], one, want[i]);
+        error();
+      }
+    }
+    if (chain_jit(prog) == 0) {
+      memcpy(in, got, len * sizeof(unsigned long));
+      chain_eval_array(prog, in, len);
+      for (unsigned long i = 0; i < len; i++) {
+        if (in[i] != want[i]) {
+          printf("native chain of %d stages on %lu gives %lu, scalar %lu\n",
+                 nops, got[i], in[i], want[i]);
+          error();
+        }
+      }
+    }
+    free(in);
+    chain_free(prog);
+  }
+}
+
+void check_compiled() {
+  char *specs[] = {"sr", "dsr", "sdr", "rrsr", "rsr", "ssrr", "dds", "sdsd",
+                   "rdsr", "rrdsr", "rrrsrsr", "dsrdsr"};
+  unsigned long *want = malloc(nvals * sizeof(unsigned long));
+  unsigned long *got = malloc(nvals * sizeof(unsigned long));
+  if (want == NULL || got == NULL)
+    error();
+  int ops[128];
+  int nchains = 0;
+  for (unsigned long i = 0; i < sizeof(specs) / sizeof(specs[0]); i++) {
+    int n = parse_chain(specs[i], ops);
+    check_chain(ops, n, want, got, nvals, 0);
+    nchains++;
+  }
+  // Doublings alone, up to and past the point where nothing is left.
+  for (int n = 1; n < 70; n++) {
+    for (int j = 0; j < n; j++)
+      ops[j] = OP_DOUBLE;
+    ops[n] = OP_SQROOT;
+    check_chain(ops, n + 1, want, got, 4096, 1);
+    nchains++;
+  }
+  for (int c = 0; c < 3000; c++) {
+    int n = 1 + lcg() % (c < 2900 ? 24 : 128);
+    for (int j = 0; j < n; j++) {
+      unsigned long pick = lcg() % 8;
+      ops[j] = pick < 4 ? OP_DOUBLE : pick < 6 ? OP_SQUARE : OP_SQROOT;
+    }
+    check_chain(ops, n, want, got, 4096, 1);
+    nchains++;
+  }
+  printf("%d chains: compiled programs match the unfused scalar path\n",
+         nchains);
+  free(want);
+  free(got);
+}
+
+void check_cache() {
+  struct chain_cache *cache = chain_cache_open(NULL, 64);
+  unsigned long want[4096], got[4096];
+  int ops[24];
+  if (cache == NULL)
+    error();
+  for (int c = 0; c < 300; c++) {
+    int n = 1 + lcg() % 24;
+    for (int j = 0; j < n; j++)
+      ops[j] = lcg() % OP_COUNT;
+    struct chain_prog *prog = chain_compile(ops, n);
+    if (prog == NULL)
+      error();
+    for (int round = 0; round < 2; round++) {
+      for (int i = 0; i < 4096; i++)
+        want[i] = got[i] = vals[(lcg() % 97) * 7919 % nvals];
+      chain_eval_array(prog, want, 4096);
+      chain_cache_eval(cache, prog, got, 4096);
+      for (int i = 0; i < 4096; i++) {
+        if (got[i] != want[i]) {
+          printf("cached chain of %d stages gives %lu, not %lu\n", n, got[i],
+                 want[i]);
+          error();
+        }
+      }
+    }
+    chain_free(prog);
+  }
+  unsigned long hits, misses;
+  chain_cache_stats(cache, &hits, &misses);
+  printf("300 chains: cached results match (%lu hits, %lu misses)\n", hits,
+         misses);
+  chain_cache_close(cache);
+}
+
+void bench(unsigned long count) {
+  char *names[OP_COUNT] = {"double", "square", "sqroot"};
+  unsigned long *buf = malloc(count * sizeof(unsigned long));
+  if (buf == NULL)
+    error();
+  printf("%-8s %-8s %10s %12s\n", "op", "kernels", "ns/op", "Mops/s");
+  for (int op = 0; op < OP_COUNT; op++) {
+    for (int isa = CHAIN_SCALAR; isa <= chain_isa_best(); isa++) {
+      double best = 0;
+      for (int rep = 0; rep < 5; rep++) {
+        lcg_state = 211152;
+        for (unsigned long i = 0; i < count; i++)
+          buf[i] = rand64();
+        double start = now();
+        chain_run_isa(isa, &op, 1, buf, count);
+        double secs = now() - start;
+        if (rep == 0 || secs < best)
+          best = secs;
+      }
+      printf("%-8s %-8s %10.2f %12.0f\n", names[op], chain_isa_name(isa),
+             best * 1e9 / count, count / best / 1e6);
+    }
+  }
+
+  char *specs[] = {"dddd", "dsr", "sdrd", "rrsr", "dsdsrr", "ddsrddsdrr",
+                   "sdrdsdrdsdrdsdrdsdrd"};
+  int isa = chain_isa_best();
+  printf("\n%-22s %5s %12s %12s\n", "chain", "steps", "staged ns/op",
+         "fused ns/op");
+  for (unsigned long c = 0; c < sizeof(specs) / sizeof(specs[0]); c++) {
+    int ops[32];
+    int n = parse_chain(specs[c], ops);
+    struct chain_prog *prog = chain_compile(ops, n);
+    if (prog == NULL)
+      error();
+    double staged = 0, fused = 0;
+    for (int rep = 0; rep < 5; rep++) {
+      lcg_state = 211152;
+      for (unsigned long i = 0; i < count; i++)
+        buf[i] = rand64();
+      double start = now();
+      chain_run_isa(isa, ops, n, buf, count);
+      double secs = now() - start;
+      if (rep == 0 || secs < staged)
+        staged = secs;
+      lcg_state = 211152;
+      for (unsigned long i = 0; i < count; i++)
+        buf[i] = rand64();
+      start = now();
+      chain_eval_array(prog, buf, count);
+      secs = now() - start;
+      if (rep == 0 || secs < fused)
+        fused = secs;
+    }
+    printf("%-22s %5d %12.2f %12.2f\n", specs[c], prog->nsteps,
+           staged * 1e9 / count, fused * 1e9 / count);
+    chain_free(prog);
+  }
+  free(buf);
+}
+
+void bench_sqrt(unsigned long count) {
+  struct {
+    char *name;
+    int lo, hi; // Operands of lo to hi - 1 significant bits
+  } ranges[] = {{"< 2^32", 0, 32},
+                {"2^32..2^53", 33, 53},
+                {"2^53..2^64", 54, 64},
+                {"all u64", 0, 64}};
+  struct {
+    char *name;
+    unsigned long (*fn)(unsigned long);
+  } fns[] = {{"libm", sqrt_libm},
+             {"float+fix", chain_sqrt_round},
+             {"newton", chain_sqrt_round_int}};
+  unsigned long *buf = malloc(count * sizeof(unsigned long));
+  if (buf == NULL)
+    error();
+  printf("\n%-12s %-10s %10s %12s\n", "sqrt range", "method", "ns/op",
+         "inexact");
+  for (unsigned long r = 0; r < sizeof(ranges) / sizeof(ranges[0]); r++) {
+    lcg_state = 211152;
+    int span = ranges[r].hi - ranges[r].lo + 1;
+    for (unsigned long i = 0; i < count; i++) {
+      int bits = ranges[r].lo + lcg() % span;
+      buf[i] = bits == 0 ? 0 : rand64() >> (64 - bits) | 1UL << (bits - 1);
+    }
+    for (unsigned long f = 0; f < sizeof(fns) / sizeof(fns[0]); f++) {
+      unsigned long inexact = 0;
+      for (unsigned long i = 0; i < count; i++)
+        inexact += !sqrt_exact(buf[i], fns[f].fn(buf[i]));
+      double best = 0;
+      for (int rep = 0; rep < 5; rep++) {
+        volatile unsigned long sink = 0;
+        unsigned long sum = 0;
+        double start = now();
+        for (unsigned long i = 0; i < count; i++)
+          sum += fns[f].fn(buf[i]);
+        double secs = now() - start;
+        sink = sum;
+        (void)sink;
+        if (rep == 0 || secs < best)
+          best = secs;
+      }
+      printf("%-12s %-10s %10.2f %12lu\n", ranges[r].name, fns[f].name,
+             best * 1e9 / count, inexact);
+    }
+  }
+  free(buf);
+}
+
+// Random chains of 10 to 100 stages, fused and as native code.
+void bench_jit(unsigned long count) {
+  int lens[] = {10, 20, 50, 100};
+  unsigned long *buf = malloc(count * sizeof(unsigned long));
+  if (buf == NULL)
+    error();
+  printf("\n%-14s %5s %12s %12s %8s\n", "random chain", "steps",
+         "fused ns/op", "native ns/op", "speedup");
+  for (unsigned long c = 0; c < sizeof(lens) / sizeof(lens[0]); c++) {
+    int ops[100];
+    struct chain_prog *prog = NULL;
+    lcg_state = 211152 + c;
+    do { // Enough doublings in a row leave a constant; draw another
+      chain_free(prog);
+      for (int j = 0; j < lens[c]; j++) {
+        unsigned long pick = lcg() % 8;
+        ops[j] = pick < 4 ? OP_DOUBLE : pick < 6 ? OP_SQUARE : OP_SQROOT;
+      }
+      if ((prog = chain_compile(ops, lens[c])) == NULL)
+        error();
+    } while (prog->nsteps == 0 || prog->steps[0].kind == STEP_CONST);
+    struct chain_prog *jit = chain_compile(ops, lens[c]);
+    if (jit == NULL)
+      error();
+    if (chain_jit(jit) < 0) {
+      printf("%-14d no native code for this CPU\n", lens[c]);
+      chain_free(prog);
+      chain_free(jit);
+      continue;
+    }
+    double fused = 0, native = 0;
+    for (int rep = 0; rep < 5; rep++) {
+      lcg_state = 211152;
+      for (unsigned long i = 0; i < count; i++)
+        buf[i] = rand64();
+      double start = now();
+      chain_eval_array(prog, buf, count);
+      double secs = now() - start;
+      if (rep == 0 || secs < fused)
+        fused = secs;
+      lcg_state = 211152;
+      for (unsigned long i = 0; i < count; i++)
+        buf[i] = rand64();
+      start = now();
+      chain_eval_array(jit, buf, count);
+      secs = now() - start;
+      if (rep == 0 || secs < native)
+        native = secs;
+    }
+    printf("%-14d %5d %12.2f %12.2f %7.2fx\n", lens[c], prog->nsteps,
+           fused * 1e9 / count, native * 1e9 / count, fused / native);
+    chain_free(prog);
+    chain_free(jit);
+  }
+  free(buf);
+}
+
+// Chains over count operands drawn from 4096 values, fused and cached.
+void bench_cache(unsigned long count) {
+  char *specs[] = {"dsr", "sdrdsdrdsdrdsdrdsdrd"};
+  unsigned long *buf = malloc(count * sizeof(unsigned long));
+  unsigned long pool[4096];
+  if (buf == NULL)
+    error();
+  for (int i = 0; i < 4096; i++)
+    pool[i] = rand64();
+  printf("\n%-22s %12s %12s %12s\n", "cached chain", "fused ns/op",
+         "cached ns/op", "hit rate");
+  for (unsigned long c = 0; c < sizeof(specs) / sizeof(specs[0]); c++) {
+    int ops[32];
+    int n = parse_chain(specs[c], ops);
+    struct chain_prog *prog = chain_compile(ops, n);
+    struct chain_cache *cache = chain_cache_open(NULL, 1 << 16);
+    if (prog == NULL || cache == NULL)
+      error();
+    double fused = 0, cached = 0;
+    for (int rep = 0; rep < 5; rep++) {
+      lcg_state = 211152;
+      for (unsigned long i = 0; i < count; i++)
+        buf[i] = pool[lcg() % 4096];
+      double start = now();
+      chain_eval_array(prog, buf, count);
+      double secs = now() - start;
+      if (rep == 0 || secs < fused)
+        fused = secs;
+      lcg_state = 211152;
+      for (unsigned long i = 0; i < count; i++)
+        buf[i] = pool[lcg() % 4096];
+      start = now();
+      chain_cache_eval(cache, prog, buf, count);
+      secs = now() - start;
+      if (rep == 0 || secs < cached)
+        cached = secs;
+    }
+    unsigned long hits, misses;
+    chain_cache_stats(cache, &hits, &misses);
+    printf("%-22s %12.2f %12.2f %11.1f%%\n", specs[c], fused * 1e9 / count,
+           cached * 1e9 / count, 100.0 * hits / (hits + misses));
+    chain_cache_close(cache);
+    chain_free(prog);
+  }
+  free(buf);
+}
+
+int main(int argc, char *argv[]) {
+  unsigned long count = 1 << 20;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--count") == 0 && i + 1 < argc)
+      count = strtoul(argv[++i], NULL, 10);
+    else
+      error();
+  }
+  if (count == 0)
+    error();
+  gen_edges();
+  check();
+  check_compiled();
+  check_cache();
+  bench(count);
+  bench_sqrt(count);
+  bench_cache(count);
+  bench_jit(count);
+  return 0;
+}
@@ -0,0 +1,224 @@
+/*
+ * End-to-end latency of a chain under each way of launching its stages.
+ *
+ *   gcc -O2 -o double double.c && gcc -O2 -o square square.c
+ *   gcc -O2 -o sqroot sqroot.c chain.c -lm
+ *   gcc -O2 -o ops ops.c chain.c chain_jit.c -lm -lpthread
+ *   gcc -O2 -o bench_launch bench_launch.c chain.c -lm
+ *   ./bench_launch [--bin DIR] [--ops PATH] [--runs N] [--stages N]...
+ *
+ * DIR holds the standalone double, square and sqroot (default "."), PATH
+ * the ops binary (default "./ops"). Each chain cycles double, square,
+ * sqroot over the operand 3 and is run N times (default 200) per strategy:
+ *
+ *   exec     the standalone chain: one fork, then each stage execv()s the
+ *            next in the same process
+ *   spawn    the caller posix_spawn()s every stage itself, reading each
+ *            result back through a pipe to pass it to the next
+ *   vfork    the same with vfork() and execv()
+ *   ops      one ops process applying every stage in-process
+ *   inproc   chain_apply() in the caller, no process at all
+ *
+ * Every run's output is checked against chain_apply(). The table gives the
+ * median and 99th percentile wall time of a whole chain and the number of
+ * process images (execs) it takes. OPS_SOCKET is cleared so that ops does
+ * not forward to a daemon. Operands are zero-padded to 20 digits, since the
+ * standalone programs write each result over their argument in place.
+ */
+#include "chain.h"
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+extern char **environ;
+
+void error() {
+  printf("Unable to execute\n");
+  exit(1);
+}
+
+double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+#define MAX_STAGES 64
+
+char *names[OP_COUNT] = {"double", "square", "sqroot"};
+char *bin_dir = ".";
+char *ops_path = "./ops";
+char stage_paths[MAX_STAGES][4096];
+
+#define LAUNCH_EXEC 0
+#define LAUNCH_SPAWN 1
+#define LAUNCH_VFORK 2
+#define LAUNCH_OPS 3
+#define LAUNCH_INPROC 4
+#define LAUNCH_COUNT 5
+
+char *launch_names[LAUNCH_COUNT] = {"exec", "spawn", "vfork", "ops",
+                                    "inproc"};
+
+// Start argv with its stdout on a pipe, by posix_spawn() or vfork().
+pid_t start(char **argv, int use_vfork, int *out_fd) {
+  int fds[2];
+  pid_t pid;
+  if (pipe(fds) < 0)
+    error();
+  if (use_vfork) {
+    if ((pid = vfork()) < 0)
+      error();
+    if (pid == 0) {
+      dup2(fds[1], 1);
+      close(fds[0]);
+      close(fds[1]);
+      execv(argv[0], argv);
+      _exit(127);
+    }
+  } else {
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, fds[1], 1);
+    posix_spawn_file_actions_addclose(&actions, fds[0]);
+    posix_spawn_file_actions_addclose(&actions, fds[1]);
+    if (posix_spawn(&pid, argv[0], &actions, NULL, argv, environ) != 0)
+      error();
+    posix_spawn_file_actions_destroy(&actions);
+  }
+  close(fds[1]);
+  *out_fd = fds[0];
+  return pid;
+}
+
+// Run argv to completion and parse the number it prints.
+unsigned long run(char **argv, int use_vfork) {
+  int fd;
+  pid_t pid = start(argv, use_vfork, &fd);
+  char out[64];
+  unsigned long len = 0;
+  ssize_t n;
+  while (len < sizeof(out) - 1 &&
+         (n = read(fd, out + len, sizeof(out) - 1 - len)) > 0)
+    len += n;
+  out[len] = '\0';
+  close(fd);
+  int status;
+  if (waitpid(pid, &status, 0) < 0)
+    error();
+  char *endptr;
+  unsigned long value = strtoul(out, &endptr, 10);
+  if (endptr == out || *endptr != '\n')
+    error();
+  return value;
+}
+
+// One whole chain of nstages over operand; returns the result.
+unsigned long launch(int how, const int *ops, int nstages,
+                     unsigned long operand) {
+  char arg[32];
+  char *argv[MAX_STAGES + 3];
+  sprintf(arg, "%020lu", operand);
+  if (how == LAUNCH_EXEC || how == LAUNCH_OPS) {
+    int n = 0;
+    if (how == LAUNCH_OPS) {
+      argv[n++] = ops_path;
+      argv[n++] = names[ops[0]];
+    } else {
+      argv[n++] = stage_paths[0];
+    }
+    for (int i = 1; i < nstages; i++)
+      argv[n++] = stage_paths[i];
+    argv[n++] = arg;
+    argv[n] = NULL;
+    return run(argv, 0);
+  }
+  if (how == LAUNCH_INPROC) {
+    for (int i = 0; i < nstages; i++)
+      operand = chain_apply(ops[i], operand);
+    return operand;
+  }
+  for (int i = 0; i < nstages; i++) {
+    argv[0] = stage_paths[i];
+    argv[1] = arg;
+    argv[2] = NULL;
+    operand = run(argv, how == LAUNCH_VFORK);
+    sprintf(arg, "%020lu", operand);
+  }
+  return operand;
+}
+
+int cmp_double(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return x < y ? -1 : x > y;
+}
+
+void bench(int nstages, int runs) {
+  int ops[MAX_STAGES];
+  unsigned long want = 3;
+  for (int i = 0; i < nstages; i++) {
+    ops[i] = i % OP_COUNT;
+    want = chain_apply(ops[i], want);
+    if (snprintf(stage_paths[i], sizeof(stage_paths[i]), "%s/%s", bin_dir,
+                 names[ops[i]]) >= (int)sizeof(stage_paths[i]))
+      error();
+  }
+  double *times = malloc(runs * sizeof(double));
+  if (times == NULL)
+    error();
+  for (int how = 0; how < LAUNCH_COUNT; how++) {
+    for (int r = 0; r < runs; r++) {
+      double start = now();
+      unsigned long got = launch(how, ops, nstages, 3);
+      times[r] = now() - start;
+      if (got != want) {
+        printf("%s: %d stages give %lu, not %lu\n", launch_names[how],
+               nstages, got, want);
+        error();
+      }
+    }
+    qsort(times, runs, sizeof(double), cmp_double);
+    int execs = how == LAUNCH_OPS ? 1 : how == LAUNCH_INPROC ? 0 : nstages;
+    printf("%6d %-8s %6d %12.1f %12.1f\n", nstages, launch_names[how], execs,
+           times[runs / 2] * 1e6, times[(runs - 1) * 99 / 100] * 1e6);
+  }
+  free(times);
+}
+
+int main(int argc, char *argv[]) {
+  int runs = 200;
+  int stages[16];
+  int nstages = 0;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--bin") == 0 && i + 1 < argc)
+      bin_dir = argv[++i];
+    else if (strcmp(argv[i], "--ops") == 0 && i + 1 < argc)
+      ops_path = argv[++i];
+    else if (strcmp(argv[i], "--runs") == 0 && i + 1 < argc)
+      runs = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--stages") == 0 && i + 1 < argc && nstages < 16)
+      stages[nstages++] = atoi(argv[++i]);
+    else
+      error();
+  }
+  if (runs <= 0)
+    error();
+  if (nstages == 0) {
+    int defaults[] = {1, 2, 5, 10, 20};
+    for (; nstages < 5; nstages++)
+      stages[nstages] = defaults[nstages];
+  }
+  setenv("OPS_SOCKET", "", 1);
+  printf("%6s %-8s %6s %12s %12s\n", "stages", "launch", "execs", "p50 us",
+         "p99 us");
+  for (int i = 0; i < nstages; i++) {
+    if (stages[i] < 1 || stages[i] > MAX_STAGES)
+      error();
+    bench(stages[i], runs);
+  }
+  return 0;
+}
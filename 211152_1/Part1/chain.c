@@ -0,0 +1,784 @@
+/*
+ * Chain evaluation shared by the ops multi-call binary and its tools.
+ * See chain.h for the interface.
+ */
+#include "chain.h"
+#include <fcntl.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define CHAIN_X86 1
+#endif
+
+static const char *const op_names[OP_COUNT] = {"double", "square", "sqroot"};
+
+int chain_op(const char *path) {
+  const char *base = strrchr(path, '/');
+  base = base != NULL ? base + 1 : path;
+  for (int op = 0; op < OP_COUNT; op++)
+    if (strcmp(base, op_names[op]) == 0)
+      return op;
+  return -1;
+}
+
+#define SQRT_MAX 0xffffffffUL // The largest floor(sqrt()) of a u64
+
+/*
+ * sqrt(x) rounded to the nearest integer. (double)x drops low bits above
+ * 2^53, so round(sqrt(x)) can be one off there; its truncation is still
+ * within one of floor(sqrt(x)), which integer arithmetic then pins down.
+ * There are no ties: (r + 0.5)^2 = r^2 + r + 0.25 is never an integer, so
+ * x rounds up exactly when x > r^2 + r.
+ */
+static unsigned long sqrt_round(unsigned long x) {
+  unsigned long r = sqrt((double)x);
+  if (r > SQRT_MAX)
+    r = SQRT_MAX;
+  if (r * r > x)
+    r--;
+  else if (r < SQRT_MAX && (r + 1) * (r + 1) <= x)
+    r++;
+  return x - r * r > r ? r + 1 : r;
+}
+
+/*
+ * The same result from integer Newton steps alone, for comparison: seeded
+ * at the power of two just above sqrt(x) from the leading zero count, the
+ * iteration falls monotonically to floor(sqrt(x)) within six divisions.
+ */
+static unsigned long sqrt_round_int(unsigned long x) {
+  if (x < 2)
+    return x;
+  unsigned long r = 1UL << (65 - __builtin_clzl(x)) / 2;
+  for (;;) {
+    unsigned long next = (r + x / r) / 2;
+    if (next >= r)
+      break;
+    r = next;
+  }
+  return x - r * r > r ? r + 1 : r;
+}
+
+unsigned long chain_sqrt_round(unsigned long x) { return sqrt_round(x); }
+
+unsigned long chain_sqrt_round_int(unsigned long x) {
+  return sqrt_round_int(x);
+}
+
+unsigned long chain_apply(int op, unsigned long operand) {
+  switch (op) {
+  case OP_DOUBLE:
+    return operand * 2;
+  case OP_SQUARE:
+    return operand * operand;
+  default:
+    return sqrt_round(operand);
+  }
+}
+
+/*
+ * Array kernels, one per operation and instruction set. The vector ones
+ * run the same algorithm as the scalar code lane by lane, so results are
+ * identical; leftover elements take the scalar loop.
+ */
+typedef void (*kernel_fn)(unsigned long *vals, unsigned long count);
+
+static void scalar_double(unsigned long *vals, unsigned long count) {
+  for (unsigned long i = 0; i < count; i++)
+    vals[i] *= 2;
+}
+
+static void scalar_square(unsigned long *vals, unsigned long count) {
+  for (unsigned long i = 0; i < count; i++)
+    vals[i] *= vals[i];
+}
+
+static void scalar_sqroot(unsigned long *vals, unsigned long count) {
+  for (unsigned long i = 0; i < count; i++)
+    vals[i] = sqrt_round(vals[i]);
+}
+
+#ifdef CHAIN_X86
+__attribute__((target("avx2"))) static void
+avx2_double(unsigned long *vals, unsigned long count) {
+  unsigned long i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m256i x = _mm256_loadu_si256((__m256i *)(vals + i));
+    _mm256_storeu_si256((__m256i *)(vals + i), _mm256_add_epi64(x, x));
+  }
+  scalar_double(vals + i, count - i);
+}
+
+// The low 64 bits of x * x from 32-bit halves: lo^2 + (2 lo hi << 32).
+__attribute__((target("avx2"))) static inline __m256i avx2_mul_lo(__m256i x) {
+  __m256i cross = _mm256_mul_epu32(x, _mm256_srli_epi64(x, 32));
+  cross = _mm256_slli_epi64(_mm256_add_epi64(cross, cross), 32);
+  return _mm256_add_epi64(_mm256_mul_epu32(x, x), cross);
+}
+
+__attribute__((target("avx2"))) static void
+avx2_square(unsigned long *vals, unsigned long count) {
+  unsigned long i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m256i x = _mm256_loadu_si256((__m256i *)(vals + i));
+    _mm256_storeu_si256((__m256i *)(vals + i), avx2_mul_lo(x));
+  }
+  scalar_square(vals + i, count - i);
+}
+
+// Unsigned a > b, as a lane mask; AVX2 only compares signed.
+__attribute__((target("avx2"))) static inline __m256i avx2_ugt(__m256i a,
+                                                               __m256i b) {
+  __m256i sign = _mm256_set1_epi64x(1UL << 63);
+  return _mm256_cmpgt_epi64(_mm256_xor_si256(a, sign),
+                            _mm256_xor_si256(b, sign));
+}
+
+// sqrt_round() on four lanes.
+__attribute__((target("avx2"))) static inline __m256i
+avx2_sqrt_round(__m256i x) {
+  // u64 to double with one rounding: 2^84 + hi * 2^32 and 2^52 + lo are
+  // both exact, and subtracting the offsets leaves a single inexact add.
+  const __m256i lo_exp = _mm256_set1_epi64x(0x4330000000000000UL);
+  const __m256i hi_exp = _mm256_set1_epi64x(0x4530000000000000UL);
+  const __m256d offset = _mm256_set1_pd(19342813118337666422669312.0);
+  const __m256d two52 = _mm256_set1_pd(4503599627370496.0);
+  const __m256i max = _mm256_set1_epi64x(SQRT_MAX);
+  __m256d lo = _mm256_castsi256_pd(_mm256_blend_epi32(lo_exp, x, 0x55));
+  __m256d hi =
+      _mm256_castsi256_pd(_mm256_or_si256(_mm256_srli_epi64(x, 32), hi_exp));
+  __m256d root = _mm256_sqrt_pd(_mm256_add_pd(_mm256_sub_pd(hi, offset), lo));
+  // Nearest integer, below 2^52, read back out of the mantissa.
+  __m256i r = _mm256_sub_epi64(
+      _mm256_castpd_si256(_mm256_add_pd(root, two52)), lo_exp);
+  r = _mm256_add_epi64(r, _mm256_cmpgt_epi64(r, max));
+  __m256i sq = _mm256_mul_epu32(r, r);
+  __m256i down = avx2_ugt(sq, x);
+  __m256i next = _mm256_add_epi64(sq, _mm256_add_epi64(r, r));
+  next = _mm256_add_epi64(next, _mm256_set1_epi64x(1));
+  __m256i up = _mm256_andnot_si256(_mm256_or_si256(down, avx2_ugt(next, x)),
+                                   _mm256_cmpgt_epi64(max, r));
+  r = _mm256_sub_epi64(_mm256_add_epi64(r, down), up);
+  sq = _mm256_mul_epu32(r, r);
+  return _mm256_sub_epi64(r, avx2_ugt(_mm256_sub_epi64(x, sq), r));
+}
+
+__attribute__((target("avx2"))) static void
+avx2_sqroot(unsigned long *vals, unsigned long count) {
+  unsigned long i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m256i x = _mm256_loadu_si256((__m256i *)(vals + i));
+    _mm256_storeu_si256((__m256i *)(vals + i), avx2_sqrt_round(x));
+  }
+  scalar_sqroot(vals + i, count - i);
+}
+
+#define AVX512 "avx512f,avx512dq"
+
+__attribute__((target(AVX512))) static void
+avx512_double(unsigned long *vals, unsigned long count) {
+  unsigned long i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m512i x = _mm512_loadu_si512(vals + i);
+    _mm512_storeu_si512(vals + i, _mm512_add_epi64(x, x));
+  }
+  scalar_double(vals + i, count - i);
+}
+
+__attribute__((target(AVX512))) static void
+avx512_square(unsigned long *vals, unsigned long count) {
+  unsigned long i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m512i x = _mm512_loadu_si512(vals + i);
+    _mm512_storeu_si512(vals + i, _mm512_mullo_epi64(x, x));
+  }
+  scalar_square(vals + i, count - i);
+}
+
+// sqrt_round() on eight lanes.
+__attribute__((target(AVX512))) static inline __m512i
+avx512_sqrt_round(__m512i x) {
+  const __m512i one = _mm512_set1_epi64(1);
+  const __m512i max = _mm512_set1_epi64(SQRT_MAX);
+  __m512i r = _mm512_cvttpd_epu64(_mm512_sqrt_pd(_mm512_cvtepu64_pd(x)));
+  r = _mm512_min_epu64(r, max);
+  __m512i sq = _mm512_mullo_epi64(r, r);
+  __mmask8 down = _mm512_cmpgt_epu64_mask(sq, x);
+  __m512i next =
+      _mm512_add_epi64(_mm512_add_epi64(sq, r), _mm512_add_epi64(r, one));
+  __mmask8 up = ~down & _mm512_cmple_epu64_mask(next, x) &
+                _mm512_cmplt_epu64_mask(r, max);
+  r = _mm512_mask_sub_epi64(r, down, r, one);
+  r = _mm512_mask_add_epi64(r, up, r, one);
+  sq = _mm512_mullo_epi64(r, r);
+  __mmask8 half = _mm512_cmpgt_epu64_mask(_mm512_sub_epi64(x, sq), r);
+  return _mm512_mask_add_epi64(r, half, r, one);
+}
+
+__attribute__((target(AVX512))) static void
+avx512_sqroot(unsigned long *vals, unsigned long count) {
+  unsigned long i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m512i x = _mm512_loadu_si512(vals + i);
+    _mm512_storeu_si512(vals + i, avx512_sqrt_round(x));
+  }
+  scalar_sqroot(vals + i, count - i);
+}
+#endif
+
+static const kernel_fn kernels[CHAIN_ISA_COUNT][OP_COUNT] = {
+    {scalar_double, scalar_square, scalar_sqroot},
+#ifdef CHAIN_X86
+    {avx2_double, avx2_square, avx2_sqroot},
+    {avx512_double, avx512_square, avx512_sqroot},
+#endif
+};
+
+static const char *const isa_names[CHAIN_ISA_COUNT] = {"scalar", "avx2",
+                                                       "avx512"};
+
+int chain_isa_best(void) {
+  static int best = -1;
+  int isa = __atomic_load_n(&best, __ATOMIC_RELAXED);
+  if (isa >= 0)
+    return isa;
+  isa = CHAIN_SCALAR;
+#ifdef CHAIN_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512dq"))
+    isa = CHAIN_AVX512;
+  else if (__builtin_cpu_supports("avx2"))
+    isa = CHAIN_AVX2;
+#endif
+  __atomic_store_n(&best, isa, __ATOMIC_RELAXED);
+  return isa;
+}
+
+const char *chain_isa_name(int isa) { return isa_names[isa]; }
+
+void chain_run_isa(int isa, const int *ops, int nops, unsigned long *vals,
+                   unsigned long count) {
+  // Stage by stage, so each pass is one tight loop over the array.
+  for (int s = 0; s < nops; s++)
+    kernels[isa][ops[s]](vals, count);
+}
+
+void chain_run(const int *ops, int nops, unsigned long *vals,
+               unsigned long count) {
+  chain_run_isa(chain_isa_best(), ops, nops, vals, count);
+}
+
+/*
+ * Chain compiler. ops are rewritten into steps left to right, keeping an
+ * upper bound of the value after each step:
+ *   - consecutive doublings are one shift;
+ *   - a shift moves past a following square as twice the shift, since
+ *     (x << a)^2 = x^2 << 2a mod 2^64, so it can merge with later ones;
+ *   - a square directly followed by sqroot is one step, which is x itself
+ *     when x * x cannot wrap, and is dropped when the bound shows it never
+ *     does;
+ *   - a shift of 64 or more leaves 0 whatever came before, and steps on a
+ *     constant are folded into it.
+ * A square is not moved past a shift when sqroot follows it, so the pair
+ * can still fuse.
+ */
+static unsigned long step_bound(unsigned long bound, int kind,
+                                unsigned long arg) {
+  switch (kind) {
+  case STEP_SHL:
+    return bound <= ~0UL >> arg ? bound << arg : ~0UL;
+  case STEP_SQUARE:
+    return bound <= SQRT_MAX ? bound * bound : ~0UL;
+  case STEP_SQROOT:
+    return sqrt_round(bound); // Monotonic
+  case STEP_SQUARE_SQROOT:
+    return bound <= SQRT_MAX ? bound : SQRT_MAX + 1;
+  default:
+    return arg;
+  }
+}
+
+static inline __attribute__((always_inline)) unsigned long
+scalar_step(unsigned long x, int kind, unsigned long arg) {
+  switch (kind) {
+  case STEP_SHL:
+    return x << arg;
+  case STEP_SQUARE:
+    return x * x;
+  case STEP_SQROOT:
+    return sqrt_round(x);
+  case STEP_SQUARE_SQROOT:
+    return x <= SQRT_MAX ? x : sqrt_round(x * x);
+  default:
+    return arg;
+  }
+}
+
+struct compiler {
+  struct chain_step *steps;
+  unsigned long *bounds; // bounds[i]: the value after i steps is at most this
+  int n;
+};
+
+static void emit(struct compiler *c, int kind, unsigned long arg) {
+  if (kind == STEP_SHL) {
+    if (c->n > 0 && c->steps[c->n - 1].kind == STEP_SHL)
+      arg += c->steps[--c->n].arg;
+    if (arg == 0)
+      return;
+    if (arg >= 64) {
+      c->n = 0;
+      kind = STEP_CONST;
+      arg = 0;
+    }
+  }
+  if (c->n > 0 && c->steps[0].kind == STEP_CONST) {
+    c->steps[0].arg = scalar_step(c->steps[0].arg, kind, arg);
+    c->bounds[1] = c->steps[0].arg;
+    return;
+  }
+  c->steps[c->n].kind = kind;
+  c->steps[c->n].arg = arg;
+  c->bounds[c->n + 1] = step_bound(c->bounds[c->n], kind, arg);
+  c->n++;
+}
+
+static int top_kind(struct compiler *c) {
+  return c->n > 0 ? c->steps[c->n - 1].kind : -1;
+}
+
+/*
+ * Fused runners. The isa_step() functions apply one step to one register;
+ * the templates below instantiate a loop for every step kind and a runner
+ * for every program of one or two steps, with the kinds as constants so
+ * the switches fold away, and a blocked runner for longer programs.
+ */
+#ifdef CHAIN_X86
+__attribute__((target("avx2"), always_inline)) static inline __m256i
+avx2_step(__m256i x, int kind, unsigned long arg) {
+  switch (kind) {
+  case STEP_SHL:
+    return _mm256_sll_epi64(x, _mm_cvtsi64_si128(arg));
+  case STEP_SQUARE:
+    return avx2_mul_lo(x);
+  case STEP_SQROOT:
+    return avx2_sqrt_round(x);
+  case STEP_SQUARE_SQROOT: {
+    __m256i big = avx2_ugt(x, _mm256_set1_epi64x(SQRT_MAX));
+    if (_mm256_testz_si256(big, big))
+      return x;
+    return _mm256_blendv_epi8(x, avx2_sqrt_round(avx2_mul_lo(x)), big);
+  }
+  default:
+    return _mm256_set1_epi64x(arg);
+  }
+}
+
+__attribute__((target(AVX512), always_inline)) static inline __m512i
+avx512_step(__m512i x, int kind, unsigned long arg) {
+  switch (kind) {
+  case STEP_SHL:
+    return _mm512_sll_epi64(x, _mm_cvtsi64_si128(arg));
+  case STEP_SQUARE:
+    return _mm512_mullo_epi64(x, x);
+  case STEP_SQROOT:
+    return avx512_sqrt_round(x);
+  case STEP_SQUARE_SQROOT: {
+    __mmask8 big = _mm512_cmpgt_epu64_mask(x, _mm512_set1_epi64(SQRT_MAX));
+    if (big == 0)
+      return x;
+    return _mm512_mask_mov_epi64(
+        x, big, avx512_sqrt_round(_mm512_mullo_epi64(x, x)));
+  }
+  default:
+    return _mm512_set1_epi64(arg);
+  }
+}
+#endif
+
+// What the templates need to know about each kernel set.
+#define scalar_ATTR
+#define scalar_W 1
+#define scalar_V unsigned long
+#define scalar_LOAD(p) (*(p))
+#define scalar_STORE(p, x) (*(p) = (x))
+#define avx2_ATTR __attribute__((target("avx2")))
+#define avx2_W 4
+#define avx2_V __m256i
+#define avx2_LOAD(p) _mm256_loadu_si256((__m256i *)(p))
+#define avx2_STORE(p, x) _mm256_storeu_si256((__m256i *)(p), x)
+#define avx512_ATTR __attribute__((target(AVX512)))
+#define avx512_W 8
+#define avx512_V __m512i
+#define avx512_LOAD(p) _mm512_loadu_si512(p)
+#define avx512_STORE(p, x) _mm512_storeu_si512(p, x)
+
+// The loop around BODY, which steps x; leftovers go to TAIL.
+#define RUN_LOOP(isa, BODY, TAIL)                                              \
+  unsigned long i = 0;                                                         \
+  for (; i + isa##_W <= count; i += isa##_W) {                                 \
+    isa##_V x = isa##_LOAD(vals + i);                                          \
+    BODY;                                                                      \
+    isa##_STORE(vals + i, x);                                                  \
+  }                                                                            \
+  if (i < count)                                                               \
+    TAIL;
+
+// One step of kind A over an array.
+#define LOOP1(isa, A)                                                          \
+  isa##_ATTR static void isa##_loop_##A(unsigned long a0, unsigned long *vals, \
+                                        unsigned long count) {                 \
+    RUN_LOOP(isa, x = isa##_step(x, A, a0),                                    \
+             scalar_loop_##A(a0, vals + i, count - i))                         \
+  }
+
+/*
+ * Longer programs go block by block, each block small enough to stay in L1
+ * while every step runs over it as a loop of its own: one pass over memory
+ * without holding all the steps' constants in registers at once.
+ */
+#define RUN_ANY(isa)                                                           \
+  isa##_ATTR static void isa##_run_any(const struct chain_prog *p,             \
+                                       unsigned long *vals,                    \
+                                       unsigned long count) {                  \
+    for (unsigned long i = 0; i < count; i += RUN_BLOCK) {                     \
+      unsigned long n = count - i < RUN_BLOCK ? count - i : RUN_BLOCK;         \
+      for (int s = 0; s < p->nsteps; s++) {                                    \
+        unsigned long arg = p->steps[s].arg;                                   \
+        if (p->steps[s].kind == STEP_SHL)                                      \
+          isa##_loop_0(arg, vals + i, n);                                      \
+        else if (p->steps[s].kind == STEP_SQUARE)                              \
+          isa##_loop_1(arg, vals + i, n);                                      \
+        else if (p->steps[s].kind == STEP_SQROOT)                              \
+          isa##_loop_2(arg, vals + i, n);                                      \
+        else                                                                   \
+          isa##_loop_3(arg, vals + i, n);                                      \
+      }                                                                        \
+    }                                                                          \
+  }
+
+#define RUN1(isa, A)                                                           \
+  isa##_ATTR static void isa##_run1_##A(const struct chain_prog *p,            \
+                                        unsigned long *vals,                   \
+                                        unsigned long count) {                 \
+    isa##_loop_##A(p->steps[0].arg, vals, count);                              \
+  }
+
+// Two steps in registers, the second straight after the first.
+#define RUN2(isa, A, B)                                                        \
+  isa##_ATTR static void isa##_run2_##A##_##B(const struct chain_prog *p,      \
+                                              unsigned long *vals,             \
+                                              unsigned long count) {           \
+    unsigned long a0 = p->steps[0].arg;                                        \
+    unsigned long a1 = p->steps[1].arg;                                        \
+    RUN_LOOP(isa, x = isa##_step(x, A, a0); x = isa##_step(x, B, a1),          \
+             scalar_run2_##A##_##B(p, vals + i, count - i))                    \
+  }
+
+// Kinds 0 to 3 are STEP_SHL to STEP_SQUARE_SQROOT.
+#define EACH_KIND(X, isa) X(isa, 0) X(isa, 1) X(isa, 2) X(isa, 3)
+#define EACH_PAIR(X, isa)                                                      \
+  X(isa, 0, 0) X(isa, 0, 1) X(isa, 0, 2) X(isa, 0, 3) X(isa, 1, 0)             \
+  X(isa, 1, 1) X(isa, 1, 2) X(isa, 1, 3) X(isa, 2, 0) X(isa, 2, 1)             \
+  X(isa, 2, 2) X(isa, 2, 3) X(isa, 3, 0) X(isa, 3, 1) X(isa, 3, 2)             \
+  X(isa, 3, 3)
+#define RUNNERS(isa)                                                           \
+  EACH_KIND(LOOP1, isa)                                                        \
+  RUN_ANY(isa) EACH_KIND(RUN1, isa) EACH_PAIR(RUN2, isa)
+
+#define RUN_BLOCK 512
+
+#define RUN1_REF(isa, A) isa##_run1_##A,
+#define RUN2_REF(isa, A, B) isa##_run2_##A##_##B,
+#define RUNNER_TABLE(isa)                                                      \
+  { isa##_run_any, EACH_KIND(RUN1_REF, isa) EACH_PAIR(RUN2_REF, isa) }
+
+RUNNERS(scalar)
+#ifdef CHAIN_X86
+RUNNERS(avx2)
+RUNNERS(avx512)
+#endif
+
+typedef void (*runner_fn)(const struct chain_prog *prog, unsigned long *vals,
+                          unsigned long count);
+
+// [0] any program, [1 + k] one step of kind k, [5 + 4 j + k] two steps.
+static const runner_fn runners[CHAIN_ISA_COUNT][21] = {
+    RUNNER_TABLE(scalar),
+#ifdef CHAIN_X86
+    RUNNER_TABLE(avx2),
+    RUNNER_TABLE(avx512),
+#endif
+};
+
+// An empty chain leaves every value as it is.
+static void run_none(const struct chain_prog *p, unsigned long *vals,
+                     unsigned long count) {
+  (void)p;
+  (void)vals;
+  (void)count;
+}
+
+static void run_const(const struct chain_prog *p, unsigned long *vals,
+                      unsigned long count) {
+  for (unsigned long i = 0; i < count; i++)
+    vals[i] = p->steps[0].arg;
+}
+
+struct chain_prog *chain_compile_isa(int isa, const int *ops, int nops) {
+  unsigned long size =
+      sizeof(struct chain_prog) + (nops + 1) * sizeof(struct chain_step);
+  struct chain_prog *prog = malloc(size);
+  struct compiler c;
+  c.steps = (struct chain_step *)(prog + 1);
+  c.bounds = malloc((nops + 2) * sizeof(unsigned long));
+  c.n = 0;
+  if (prog == NULL || c.bounds == NULL) {
+    free(prog);
+    free(c.bounds);
+    return NULL;
+  }
+  c.bounds[0] = ~0UL;
+  for (int i = 0; i < nops; i++) {
+    if (ops[i] == OP_DOUBLE) {
+      emit(&c, STEP_SHL, 1);
+    } else if (ops[i] == OP_SQUARE) {
+      int fuses = i + 1 < nops && ops[i + 1] == OP_SQROOT;
+      if (top_kind(&c) == STEP_SHL && !fuses) {
+        unsigned long shift = c.steps[--c.n].arg;
+        emit(&c, STEP_SQUARE, 0);
+        emit(&c, STEP_SHL, 2 * shift);
+      } else {
+        emit(&c, STEP_SQUARE, 0);
+      }
+    } else if (top_kind(&c) == STEP_SQUARE) {
+      // sqroot(x * x) is x unless the square wrapped.
+      if (c.bounds[--c.n] > SQRT_MAX)
+        emit(&c, STEP_SQUARE_SQROOT, 0);
+    } else {
+      emit(&c, STEP_SQROOT, 0);
+    }
+  }
+  free(c.bounds);
+
+  prog->isa = isa;
+  prog->nsteps = c.n;
+  prog->steps = c.steps;
+  prog->code = NULL;
+  prog->code_size = 0;
+  prog->key = 1469598103934665603UL; // FNV-1a over the steps
+  for (int s = 0; s < c.n; s++) {
+    prog->key = (prog->key ^ c.steps[s].kind) * 1099511628211UL;
+    prog->key = (prog->key ^ c.steps[s].arg) * 1099511628211UL;
+  }
+  if (prog->key == 0)
+    prog->key = 1; // 0 marks an empty cache slot
+  if (c.n == 0)
+    prog->run = run_none;
+  else if (c.steps[0].kind == STEP_CONST)
+    prog->run = run_const;
+  else if (c.n == 1)
+    prog->run = runners[isa][1 + c.steps[0].kind];
+  else if (c.n == 2)
+    prog->run = runners[isa][5 + 4 * c.steps[0].kind + c.steps[1].kind];
+  else
+    prog->run = runners[isa][0];
+  return prog;
+}
+
+struct chain_prog *chain_compile(const int *ops, int nops) {
+  return chain_compile_isa(chain_isa_best(), ops, nops);
+}
+
+unsigned long chain_eval(const struct chain_prog *prog,
+                         unsigned long operand) {
+  for (int s = 0; s < prog->nsteps; s++)
+    operand = scalar_step(operand, prog->steps[s].kind, prog->steps[s].arg);
+  return operand;
+}
+
+void chain_eval_array(const struct chain_prog *prog, unsigned long *vals,
+                      unsigned long count) {
+  prog->run(prog, vals, count);
+}
+
+void chain_free(struct chain_prog *prog) {
+  if (prog != NULL && prog->code != NULL)
+    munmap(prog->code, prog->code_size);
+  free(prog);
+}
+
+/*
+ * Result cache. A slot holds key ^ result, operand ^ result and result, so a
+ * reader that loads the three words while another thread rewrites the slot
+ * sees a torn mix that does not decode to its own key and operand, and takes
+ * it as a miss: no locks are needed, and several processes can share one
+ * file. An all-zero slot is empty, which no key of 0 can hit. Keys collide
+ * only with 64-bit hashes.
+ */
+#define CACHE_MAGIC 0x3148434143535042UL // "BPSCACH1"
+#define CACHE_PROBE 8                    // Slots searched per lookup
+#define CACHE_BLOCK 512                  // Misses gathered per evaluation
+
+struct cache_slot {
+  unsigned long key;
+  unsigned long operand;
+  unsigned long result;
+};
+
+struct cache_header {
+  unsigned long magic;
+  unsigned long nslots;
+  unsigned long hits;
+  unsigned long misses;
+};
+
+struct chain_cache {
+  struct cache_header *header;
+  struct cache_slot *slots;
+  unsigned long mask;
+  unsigned long size; // Bytes mapped
+};
+
+struct chain_cache *chain_cache_open(const char *path, unsigned long slots) {
+  unsigned long nslots = CACHE_PROBE;
+  while (nslots < slots)
+    nslots *= 2;
+  struct chain_cache *cache = malloc(sizeof(struct chain_cache));
+  if (cache == NULL)
+    return NULL;
+  void *map = MAP_FAILED;
+  if (path == NULL) {
+    cache->size =
+        sizeof(struct cache_header) + nslots * sizeof(struct cache_slot);
+    map = mmap(NULL, cache->size, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  } else {
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    struct stat st;
+    if (fd >= 0 && fstat(fd, &st) == 0) {
+      // An existing cache keeps its size; a new one is zeroed by ftruncate.
+      struct cache_header header;
+      if (st.st_size >= (long)sizeof(header) &&
+          pread(fd, &header, sizeof(header), 0) == sizeof(header) &&
+          header.magic == CACHE_MAGIC && header.nslots != 0 &&
+          (header.nslots & (header.nslots - 1)) == 0)
+        nslots = header.nslots;
+      cache->size =
+          sizeof(struct cache_header) + nslots * sizeof(struct cache_slot);
+      if (st.st_size == (long)cache->size ||
+          (st.st_size == 0 && ftruncate(fd, cache->size) == 0))
+        map = mmap(NULL, cache->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+                   0);
+    }
+    if (fd >= 0)
+      close(fd);
+  }
+  if (map == MAP_FAILED) {
+    free(cache);
+    return NULL;
+  }
+  cache->header = map;
+  cache->slots = (struct cache_slot *)(cache->header + 1);
+  cache->mask = nslots - 1;
+  if (cache->header->magic != CACHE_MAGIC) {
+    cache->header->nslots = nslots;
+    __atomic_store_n(&cache->header->magic, CACHE_MAGIC, __ATOMIC_RELEASE);
+  }
+  if (cache->header->nslots != nslots) {
+    chain_cache_close(cache);
+    return NULL;
+  }
+  return cache;
+}
+
+static unsigned long cache_index(unsigned long key, unsigned long operand) {
+  unsigned long h = key ^ operand * 0x9e3779b97f4a7c15UL;
+  h *= 0xff51afd7ed558ccdUL;
+  return h ^ h >> 32;
+}
+
+static int cache_get(struct chain_cache *cache, unsigned long key,
+                     unsigned long operand, unsigned long *result) {
+  unsigned long i = cache_index(key, operand);
+  for (int probe = 0; probe < CACHE_PROBE; probe++) {
+    struct cache_slot *slot = &cache->slots[(i + probe) & cache->mask];
+    unsigned long r = __atomic_load_n(&slot->result, __ATOMIC_RELAXED);
+    unsigned long k = __atomic_load_n(&slot->key, __ATOMIC_RELAXED) ^ r;
+    if (k == key &&
+        (__atomic_load_n(&slot->operand, __ATOMIC_RELAXED) ^ r) == operand) {
+      *result = r;
+      return 1;
+    }
+    if (k == 0) // Empty
+      return 0;
+  }
+  return 0;
+}
+
+// Store in the first slot that is empty or holds the same entry, else over
+// the first one probed.
+static void cache_put(struct chain_cache *cache, unsigned long key,
+                      unsigned long operand, unsigned long result) {
+  unsigned long i = cache_index(key, operand);
+  struct cache_slot *slot = &cache->slots[i & cache->mask];
+  for (int probe = 0; probe < CACHE_PROBE; probe++) {
+    struct cache_slot *s = &cache->slots[(i + probe) & cache->mask];
+    unsigned long r = __atomic_load_n(&s->result, __ATOMIC_RELAXED);
+    unsigned long k = __atomic_load_n(&s->key, __ATOMIC_RELAXED) ^ r;
+    if (k == 0 ||
+        (k == key &&
+         (__atomic_load_n(&s->operand, __ATOMIC_RELAXED) ^ r) == operand)) {
+      slot = s;
+      break;
+    }
+  }
+  __atomic_store_n(&slot->key, key ^ result, __ATOMIC_RELAXED);
+  __atomic_store_n(&slot->operand, operand ^ result, __ATOMIC_RELAXED);
+  __atomic_store_n(&slot->result, result, __ATOMIC_RELAXED);
+}
+
+void chain_cache_eval(struct chain_cache *cache, const struct chain_prog *prog,
+                      unsigned long *vals, unsigned long count) {
+  unsigned long hits = 0;
+  for (unsigned long start = 0; start < count; start += CACHE_BLOCK) {
+    unsigned long n = count - start < CACHE_BLOCK ? count - start : CACHE_BLOCK;
+    unsigned long miss[CACHE_BLOCK];
+    unsigned long miss_at[CACHE_BLOCK];
+    unsigned long nmiss = 0;
+    for (unsigned long i = start; i < start + n; i++) {
+      if (!cache_get(cache, prog->key, vals[i], &vals[i])) {
+        miss_at[nmiss] = i;
+        miss[nmiss++] = vals[i];
+      }
+    }
+    hits += n - nmiss;
+    if (nmiss == 0)
+      continue;
+    unsigned long out[CACHE_BLOCK];
+    memcpy(out, miss, nmiss * sizeof(unsigned long));
+    prog->run(prog, out, nmiss);
+    for (unsigned long j = 0; j < nmiss; j++) {
+      vals[miss_at[j]] = out[j];
+      cache_put(cache, prog->key, miss[j], out[j]);
+    }
+  }
+  __atomic_fetch_add(&cache->header->hits, hits, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&cache->header->misses, count - hits, __ATOMIC_RELAXED);
+}
+
+void chain_cache_stats(struct chain_cache *cache, unsigned long *hits,
+                       unsigned long *misses) {
+  *hits = __atomic_load_n(&cache->header->hits, __ATOMIC_RELAXED);
+  *misses = __atomic_load_n(&cache->header->misses, __ATOMIC_RELAXED);
+}
+
+void chain_cache_close(struct chain_cache *cache) {
+  munmap(cache->header, cache->size);
+  free(cache);
+}
@@ -0,0 +1,128 @@
+#ifndef CHAIN_H
+#define CHAIN_H
+
+/*
+ * The Part1 operations as plain functions, so a whole chain can run in one
+ * process. Each gives what its standalone program prints: arithmetic wraps
+ * modulo 2^64 and sqroot rounds the square root to the nearest integer.
+ * Above 2^53 sqroot is exact where the standalone round(sqrt()) can be one
+ * off.
+ */
+#define OP_DOUBLE 0
+#define OP_SQUARE 1
+#define OP_SQROOT 2
+#define OP_COUNT 3
+
+// The operation a program path names by its basename, or -1.
+int chain_op(const char *path);
+
+unsigned long chain_apply(int op, unsigned long operand);
+
+/*
+ * sqroot: sqrt(x) rounded to the nearest integer, exact over all of u64.
+ * The first corrects a double estimate, the second uses integer Newton
+ * steps only; chain_apply() and the kernels use the first.
+ */
+unsigned long chain_sqrt_round(unsigned long x);
+unsigned long chain_sqrt_round_int(unsigned long x);
+
+// Apply ops[0, nops) in order to each of vals[0, count), in place.
+void chain_run(const int *ops, int nops, unsigned long *vals,
+               unsigned long count);
+
+/*
+ * Kernel sets for chain_run(), picked once from what the CPU supports. All
+ * of them give bit-identical results.
+ */
+#define CHAIN_SCALAR 0
+#define CHAIN_AVX2 1
+#define CHAIN_AVX512 2 // AVX-512F and DQ
+#define CHAIN_ISA_COUNT 3
+
+// The best set this CPU runs; every set up to it works too.
+int chain_isa_best(void);
+
+const char *chain_isa_name(int isa);
+
+// chain_run() with the given kernel set.
+void chain_run_isa(int isa, const int *ops, int nops, unsigned long *vals,
+                   unsigned long count);
+
+/*
+ * A chain compiled once for many operands. Doublings merge into shifts,
+ * square followed by sqroot becomes x wherever x * x does not wrap, and a
+ * chain that always ends at the same value is that constant (see chain.c).
+ * Running a program takes each block of operands through every step in
+ * registers, in one pass, with the kernel set it was compiled for.
+ */
+#define STEP_SHL 0           // x << arg; arg < 64
+#define STEP_SQUARE 1        // x * x
+#define STEP_SQROOT 2        // sqroot
+#define STEP_SQUARE_SQROOT 3 // sqroot(x * x), which is x below 2^32
+#define STEP_CONST 4         // arg; only ever the one step
+
+struct chain_step {
+  int kind;
+  unsigned long arg;
+};
+
+struct chain_prog {
+  int isa;
+  int nsteps;
+  struct chain_step *steps;
+  unsigned long key; // Hash of the steps, never 0; chains that compile
+                     // alike share it
+  void (*run)(const struct chain_prog *prog, unsigned long *vals,
+              unsigned long count);
+  void *code; // Native code from chain_jit(), or NULL
+  unsigned long code_size;
+};
+
+// Compile ops[0, nops); NULL if out of memory.
+struct chain_prog *chain_compile(const int *ops, int nops);
+
+struct chain_prog *chain_compile_isa(int isa, const int *ops, int nops);
+
+unsigned long chain_eval(const struct chain_prog *prog, unsigned long operand);
+
+// chain_run() with a compiled chain.
+void chain_eval_array(const struct chain_prog *prog, unsigned long *vals,
+                      unsigned long count);
+
+void chain_free(struct chain_prog *prog);
+
+/*
+ * Translate prog into native code in an executable mapping and run that
+ * instead: every step stays in registers from load to store, with no loop
+ * per step. Returns 0, or -1 where the code cannot be generated (only
+ * AVX-512 programs are, and not constant ones), leaving the interpreter in
+ * place. Results are bit-identical either way.
+ */
+int chain_jit(struct chain_prog *prog);
+
+/*
+ * A fixed-size cache of chain results, keyed by program and operand. It is
+ * lock-free, so threads may share one, and with a path it lives in that
+ * file, mapped shared, so it persists across runs and processes; without
+ * one it is anonymous memory. Entries are overwritten as the table fills.
+ */
+struct chain_cache;
+
+/*
+ * Open or create a cache of at least slots entries (24 bytes each, rounded
+ * up to a power of two); an existing file keeps its own size. NULL on
+ * error.
+ */
+struct chain_cache *chain_cache_open(const char *path, unsigned long slots);
+
+// chain_eval_array() answering from the cache where it can.
+void chain_cache_eval(struct chain_cache *cache, const struct chain_prog *prog,
+                      unsigned long *vals, unsigned long count);
+
+// Lookups answered and not answered since the cache was created.
+void chain_cache_stats(struct chain_cache *cache, unsigned long *hits,
+                       unsigned long *misses);
+
+void chain_cache_close(struct chain_cache *cache);
+
+#endif
@@ -0,0 +1,250 @@
+/*
+ * Native code for compiled chains. See chain_jit() in chain.h.
+ *
+ * The generated function takes vals and a count of JIT_LANES-operand
+ * blocks. It keeps JIT_VECS vectors of eight operands in zmm0 onwards and
+ * applies each step to all of them before the next, so a long chain never
+ * touches memory between its load and its store and the out-of-order core
+ * overlaps the vectors' dependency chains.
+ *
+ * sqroot takes a shorter route than the kernels in chain.c, though to the
+ * same exact result. vsqrtpd is slow and runs on one port only, so the
+ * estimate of sqrt(x) comes from vrsqrt14pd (14 bits) and two Goldschmidt
+ * iterations, which leave it well within 2^-40 relative. Rounded to the
+ * nearest integer R, it is within one of the answer; R is right when
+ * R^2 - R < x <= R^2 + R, so d = x - R^2 alone says which way to correct it.
+ */
+#include "chain.h"
+#include <string.h>
+#include <sys/mman.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define JIT_VECS 8
+#define JIT_LANES (8 * JIT_VECS)
+
+// Registers: x in 0 to JIT_VECS - 1, scratch from 16, constants from 27.
+#define Z_R 16 // sqrt_round() result
+#define Z_D 17 // x - R^2
+#define Z_T 18 // scratch
+#define Z_Y 19 // x * x for a fused square and sqroot
+#define Z_G 20 // Goldschmidt: g -> sqrt(x)
+#define Z_H 21 //              h -> 1 / (2 sqrt(x))
+#define Z_E 22 //              1/2 - g h
+#define Z_ONE_PD 27
+#define Z_HALF_PD 28
+#define Z_ZERO 29
+#define Z_MAX 30
+#define Z_ONE 31
+
+// EVEX pp and opcode map fields.
+#define PP_66 1
+#define PP_F3 2
+#define MAP_0F 1
+#define MAP_0F38 2
+#define MAP_0F3A 3
+
+// vpcmpq and vpcmpuq predicates.
+#define CMP_LE 2
+#define CMP_NE 4
+#define CMP_GT 6
+
+struct emitter {
+  unsigned char *p;
+  unsigned char *end;
+  int overflow; // Set once anything did not fit; the code is then unused
+};
+
+static void put(struct emitter *e, const void *bytes, unsigned long len) {
+  if (e->overflow || (unsigned long)(e->end - e->p) < len) {
+    e->overflow = 1;
+    return;
+  }
+  memcpy(e->p, bytes, len);
+  e->p += len;
+}
+
+/*
+ * One EVEX.512.W1 instruction. reg, vvvv and rm are vector registers 0 to 31
+ * (vvvv 0 when unused, reg a mask register for compares, rm a general one
+ * for vpbroadcastq); base >= 0 makes rm the memory operand [base + 64 disp].
+ * mask and imm are left out when negative.
+ */
+static void evex(struct emitter *e, int map, int pp, int opcode, int reg,
+                 int vvvv, int rm, int base, int disp, int mask, int imm) {
+  int b = base >= 0 ? base : rm;
+  unsigned char insn[8];
+  int n = 0;
+  insn[n++] = 0x62;
+  insn[n++] = (~reg & 8) << 4 | (base >= 0 ? 0x40 : (~rm & 16) << 2) |
+              (~b & 8) << 2 | (~reg & 16) | map;
+  insn[n++] = 0x80 | (~vvvv & 15) << 3 | 4 | pp;
+  insn[n++] = 0x40 | (~vvvv & 16) >> 1 | (mask > 0 ? mask : 0);
+  insn[n++] = opcode;
+  if (base >= 0) {
+    insn[n++] = 0x40 | (reg & 7) << 3 | (b & 7); // [base + disp8 * 64]
+    insn[n++] = disp;
+  } else {
+    insn[n++] = 0xc0 | (reg & 7) << 3 | (rm & 7);
+  }
+  if (imm >= 0)
+    insn[n++] = imm;
+  put(e, insn, n);
+}
+
+// dst = op(a, b) for a three-operand instruction, under mask if > 0.
+static void vop(struct emitter *e, int map, int opcode, int dst, int a, int b,
+                int mask) {
+  evex(e, map, PP_66, opcode, dst, a, b, -1, 0, mask, -1);
+}
+
+#define VPADDQ(e, d, a, b, k) vop(e, MAP_0F, 0xd4, d, a, b, k)
+#define VPSUBQ(e, d, a, b, k) vop(e, MAP_0F, 0xfb, d, a, b, k)
+#define VPMULLQ(e, d, a, b) vop(e, MAP_0F38, 0x40, d, a, b, 0)
+#define VMOVDQA64(e, d, s, k)                                                  \
+  evex(e, MAP_0F, PP_66, 0x6f, d, 0, s, -1, 0, k, -1)
+
+// k = pred(a, b), signed (vpcmpq) or not, and-ed into k when merge is set.
+static void vpcmp(struct emitter *e, int k, int a, int b, int pred, int sign,
+                  int merge) {
+  evex(e, MAP_0F3A, PP_66, sign ? 0x1f : 0x1e, k, a, b, -1, 0, merge ? k : 0,
+       pred);
+}
+
+/*
+ * Z_R = sqrt_round(y). The estimate is taken of max(y, 1), as the
+ * reciprocal square root of 0 is infinite; 1 is within one of sqrt(0) too.
+ * R <= 2^32, so d = y - R^2 is exact as a signed number even where R^2
+ * wraps: |d| < 3R. R goes up where d > R and down where d + R <= 0, except
+ * at R = 0.
+ */
+static void emit_sqrt(struct emitter *e, int y) {
+  evex(e, MAP_0F, PP_F3, 0x7a, Z_T, 0, y, -1, 0, 0, -1); // vcvtuqq2pd
+  vop(e, MAP_0F, 0x5f, Z_T, Z_T, Z_ONE_PD, 0);           // vmaxpd
+  evex(e, MAP_0F38, PP_66, 0x4e, Z_H, 0, Z_T, -1, 0, 0, -1); // vrsqrt14pd
+  vop(e, MAP_0F, 0x59, Z_G, Z_T, Z_H, 0);                    // vmulpd
+  vop(e, MAP_0F, 0x59, Z_H, Z_H, Z_HALF_PD, 0);
+  for (int i = 0; i < 2; i++) {
+    VMOVDQA64(e, Z_E, Z_HALF_PD, 0);
+    vop(e, MAP_0F38, 0xbc, Z_E, Z_G, Z_H, 0); // vfnmadd231pd: e -= g h
+    vop(e, MAP_0F38, 0xb8, Z_G, Z_G, Z_E, 0); // vfmadd231pd: g += g e
+    if (i == 0)
+      vop(e, MAP_0F38, 0xb8, Z_H, Z_H, Z_E, 0); // h += h e
+  }
+  evex(e, MAP_0F, PP_66, 0x79, Z_R, 0, Z_G, -1, 0, 0, -1); // vcvtpd2uqq
+  VPMULLQ(e, Z_D, Z_R, Z_R);
+  VPSUBQ(e, Z_D, y, Z_D, 0);
+  VPADDQ(e, Z_T, Z_D, Z_R, 0);
+  vpcmp(e, 1, Z_D, Z_R, CMP_GT, 1, 0);     // Up
+  vpcmp(e, 2, Z_R, Z_ZERO, CMP_NE, 0, 0);  // Down, if also...
+  vpcmp(e, 2, Z_T, Z_ZERO, CMP_LE, 1, 1);
+  VPADDQ(e, Z_R, Z_R, Z_ONE, 1);
+  VPSUBQ(e, Z_R, Z_R, Z_ONE, 2);
+}
+
+static void emit_step(struct emitter *e, int x, const struct chain_step *s) {
+  switch (s->kind) {
+  case STEP_SHL: // vpsllq x, x, arg
+    evex(e, MAP_0F, PP_66, 0x73, 6, x, x, -1, 0, 0, s->arg);
+    break;
+  case STEP_SQUARE:
+    VPMULLQ(e, x, x, x);
+    break;
+  case STEP_SQROOT:
+    emit_sqrt(e, x);
+    VMOVDQA64(e, x, Z_R, 0);
+    break;
+  case STEP_SQUARE_SQROOT: {
+    // As in the kernels, skip it all when no lane is over SQRT_MAX.
+    vpcmp(e, 4, x, Z_MAX, CMP_GT, 0, 0);
+    static const unsigned char test[] = {0xc5, 0xf9, 0x98, 0xe4, // kortestb
+                                         0x0f, 0x84};            // jz
+    put(e, test, sizeof(test));
+    unsigned char *rel = e->p;
+    put(e, "\0\0\0\0", 4);
+    VPMULLQ(e, Z_Y, x, x);
+    emit_sqrt(e, Z_Y);
+    VMOVDQA64(e, x, Z_R, 4);
+    int skip = e->p - (rel + 4);
+    if (!e->overflow)
+      memcpy(rel, &skip, 4);
+    break;
+  }
+  }
+}
+
+// x86 general-purpose register numbers.
+#define RAX 0
+#define RDI 7
+
+// Z_reg = imm in every lane.
+static void emit_broadcast(struct emitter *e, int reg, unsigned long imm) {
+  unsigned char mov[10] = {0x48, 0xb8}; // mov rax, imm64
+  memcpy(mov + 2, &imm, 8);
+  put(e, mov, sizeof(mov));
+  evex(e, MAP_0F38, PP_66, 0x7c, reg, 0, RAX, -1, 0, 0, -1); // vpbroadcastq
+}
+
+// void code(unsigned long *vals (rdi), unsigned long blocks (rsi)), blocks > 0
+static void emit_prog(struct emitter *e, const struct chain_prog *prog) {
+  emit_broadcast(e, Z_ONE, 1);
+  emit_broadcast(e, Z_MAX, 0xffffffffUL);
+  emit_broadcast(e, Z_ZERO, 0);
+  emit_broadcast(e, Z_ONE_PD, 0x3ff0000000000000UL);  // 1.0
+  emit_broadcast(e, Z_HALF_PD, 0x3fe0000000000000UL); // 0.5
+  unsigned char *loop = e->p;
+  for (int v = 0; v < JIT_VECS; v++) // vmovdqu64 zmm_v, [rdi + 64 v]
+    evex(e, MAP_0F, PP_F3, 0x6f, v, 0, 0, RDI, v, 0, -1);
+  for (int s = 0; s < prog->nsteps; s++)
+    for (int v = 0; v < JIT_VECS; v++)
+      emit_step(e, v, &prog->steps[s]);
+  for (int v = 0; v < JIT_VECS; v++) // vmovdqu64 [rdi + 64 v], zmm_v
+    evex(e, MAP_0F, PP_F3, 0x7f, v, 0, 0, RDI, v, 0, -1);
+  unsigned char next[] = {0x48, 0x81, 0xc7, 0, 0, 0, 0, // add rdi, imm32
+                          0x48, 0xff, 0xce,             // dec rsi
+                          0x0f, 0x85};                  // jnz loop
+  int stride = 8 * JIT_LANES;
+  memcpy(next + 3, &stride, 4);
+  put(e, next, sizeof(next));
+  int rel = loop - (e->p + 4);
+  put(e, &rel, 4);
+  static const unsigned char done[] = {0xc5, 0xf8, 0x77, 0xc3}; // vzeroupper
+  put(e, done, sizeof(done));                                    // ret
+}
+
+static void run_jit(const struct chain_prog *prog, unsigned long *vals,
+                    unsigned long count) {
+  unsigned long blocks = count / JIT_LANES;
+  if (blocks > 0)
+    ((void (*)(unsigned long *, unsigned long))prog->code)(vals, blocks);
+  for (unsigned long i = blocks * JIT_LANES; i < count; i++)
+    vals[i] = chain_eval(prog, vals[i]);
+}
+
+int chain_jit(struct chain_prog *prog) {
+  if (prog->isa != CHAIN_AVX512 || prog->code != NULL || prog->nsteps == 0 ||
+      prog->steps[0].kind == STEP_CONST)
+    return -1;
+  // No instruction is longer than 10 bytes, no step more than 32 of them.
+  unsigned long size = 256 + prog->nsteps * JIT_VECS * 32 * 10UL;
+  size = (size + 4095) & ~4095UL;
+  void *code = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (code == MAP_FAILED)
+    return -1;
+  struct emitter e = {code, (unsigned char *)code + size, 0};
+  emit_prog(&e, prog);
+  if (e.overflow || mprotect(code, size, PROT_READ | PROT_EXEC) < 0) {
+    munmap(code, size);
+    return -1;
+  }
+  prog->code = code;
+  prog->code_size = size;
+  prog->run = run_jit;
+  return 0;
+}
+#else
+int chain_jit(struct chain_prog *prog) {
+  (void)prog;
+  return -1;
+}
+#endif
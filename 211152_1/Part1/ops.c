@@ -0,0 +1,722 @@
+/*
+ * double, square and sqroot as one multi-call binary.
+ *
+ *   gcc -O2 -o ops ops.c chain.c chain_jit.c -lm -lpthread
+ *   ln -s ops double && ln -s ops square && ln -s ops sqroot
+ *   ./square ./double ./sqroot 3
+ *
+ * The operation comes from the basename of argv[0] (or, run as ops, from
+ * the first argument: ./ops square ./double 3). Like the standalone
+ * programs, each stage works on the last argument and hands the result to
+ * the program named next; but while the next program is one of ours and
+ * can be executed, its stage is applied in-process instead of exec'ing it.
+ * Only an unknown program is exec'd, with the rest of the chain, as before.
+ * Output and exit status are those of the standalone chain.
+ *
+ * Batch mode: with the operand left out, or given as "-", the chain is
+ * applied to every line of stdin, one decimal result per line out; with
+ * "-b", stdin and stdout hold native 8-byte unsigned integers instead.
+ *   ./square ./double ./sqroot < operands
+ * Every stage must then be one of ours. A line is read as the standalone
+ * program would read the same text as its argument, and an unreadable one
+ * fails the run as it would fail the chain. Batch input is spread over one
+ * thread per CPU, or OPS_THREADS; the output order is the input order.
+ *
+ * Daemon mode: ./ops --daemon [--socket SOCK] [--threads N] serves chains
+ * over a Unix socket (see below): SOCK, else OPS_SOCKET, else ops.sock in
+ * $XDG_RUNTIME_DIR. While a daemon owned by the same user answers on
+ * OPS_SOCKET, or on the default path with OPS_SOCKET unset, the stages a
+ * command would apply in-process are sent to it instead; with OPS_SOCKET
+ * set but empty nothing is forwarded.
+ *
+ * With OPS_CACHE naming a file, results are remembered there across runs
+ * (see chain_cache_open()) and the in-process stages, batch mode and the
+ * daemon answer from it where they can; ./ops --cache-stats prints its hit
+ * and miss counts.
+ */
+#define _GNU_SOURCE
+#include "chain.h"
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+void error() {
+  printf("Unable to execute\n");
+  exit(1);
+}
+
+// Read or write exactly len bytes; -1 on error or end of file.
+int read_full(int fd, void *buf, unsigned long len) {
+  while (len > 0) {
+    ssize_t n = read(fd, buf, len);
+    if (n <= 0)
+      return -1;
+    buf = (char *)buf + n;
+    len -= n;
+  }
+  return 0;
+}
+
+int write_full(int fd, const void *buf, unsigned long len) {
+  while (len > 0) {
+    ssize_t n = write(fd, buf, len);
+    if (n < 0)
+      return -1;
+    buf = (const char *)buf + n;
+    len -= n;
+  }
+  return 0;
+}
+
+#define CACHE_SLOTS (1 << 20)
+
+struct chain_cache *cache = NULL;
+
+void eval_batch(struct chain_prog *prog, unsigned long *vals,
+                unsigned long count) {
+  if (cache != NULL)
+    chain_cache_eval(cache, prog, vals, count);
+  else
+    chain_eval_array(prog, vals, count);
+}
+
+/*
+ * Batch I/O. Input is read in large blocks and split in place; operands are
+ * gathered BATCH at a time so the chain runs over whole arrays, and results
+ * are formatted into one large output buffer. The chain is compiled once,
+ * to native code where chain_jit() can.
+ */
+#define BATCH 4096
+
+char in_buf[(1 << 16) + 1]; // Room for a NUL after the last byte read
+char out_buf[1 << 16];
+unsigned long out_len = 0;
+
+void out_flush() {
+  if (write_full(1, out_buf, out_len) < 0)
+    error();
+  out_len = 0;
+}
+
+void out_put(const void *data, unsigned long len) {
+  if (out_len + len > sizeof(out_buf))
+    out_flush();
+  memcpy(out_buf + out_len, data, len);
+  out_len += len;
+}
+
+// Read as much as fits after the first len bytes of in_buf; 0 at EOF.
+unsigned long in_fill(unsigned long len) {
+  ssize_t n = read(0, in_buf + len, sizeof(in_buf) - 1 - len);
+  if (n < 0)
+    error();
+  return n;
+}
+
+/*
+ * The operand in [p, end), which is followed by a writable byte, into
+ * *value; -1 if the standalone program would reject it. Up to 19 digits
+ * cannot overflow and take the fast loop; anything else gets the standalone
+ * program's strtoul().
+ */
+int parse_line(char *p, char *end, unsigned long *value) {
+  unsigned long v = 0;
+  char *q = p;
+  if (end - p <= 19) {
+    while (q < end && (unsigned char)(*q - '0') < 10)
+      v = v * 10 + (*q++ - '0');
+    if (q == end) {
+      *value = v;
+      return 0;
+    }
+  }
+  *end = '\0';
+  char *endptr;
+  *value = strtoul(p, &endptr, 10);
+  return *endptr != '\0' ? -1 : 0;
+}
+
+// Format v and a newline into out, which has room for 21 bytes.
+unsigned long format_result(char *out, unsigned long v) {
+  char digits[24];
+  char *p = digits + sizeof(digits);
+  *--p = '\n';
+  do
+    *--p = '0' + v % 10;
+  while ((v /= 10) != 0);
+  memcpy(out, p, digits + sizeof(digits) - p);
+  return digits + sizeof(digits) - p;
+}
+
+void put_results(unsigned long *vals, unsigned long count) {
+  for (unsigned long i = 0; i < count; i++) {
+    char digits[24];
+    out_put(digits, format_result(digits, vals[i]));
+  }
+}
+
+void batch_text(struct chain_prog *prog) {
+  unsigned long vals[BATCH];
+  unsigned long nvals = 0;
+  unsigned long len = 0;
+  int eof = 0;
+  while (!eof) {
+    unsigned long got = in_fill(len);
+    eof = got == 0;
+    len += got;
+    char *p = in_buf;
+    char *end = in_buf + len;
+    while (p < end) {
+      char *nl = memchr(p, '\n', end - p);
+      if (nl == NULL) {
+        if (!eof)
+          break;
+        nl = end; // An unterminated last line
+      }
+      if (parse_line(p, nl, &vals[nvals++]) < 0)
+        error();
+      if (nvals == BATCH) {
+        eval_batch(prog, vals, nvals);
+        put_results(vals, nvals);
+        nvals = 0;
+      }
+      p = nl + 1;
+    }
+    // Keep a partial line for the next read.
+    len = p < end ? end - p : 0;
+    memmove(in_buf, p, len);
+    if (len == sizeof(in_buf) - 1)
+      error();
+  }
+  eval_batch(prog, vals, nvals);
+  put_results(vals, nvals);
+  out_flush();
+}
+
+void batch_binary(struct chain_prog *prog) {
+  unsigned long vals[BATCH];
+  unsigned long len = 0;
+  unsigned long got;
+  while ((got = in_fill(len)) > 0) {
+    len += got;
+    unsigned long n = len / sizeof(unsigned long);
+    for (unsigned long i = 0; i < n; i += BATCH) {
+      unsigned long count = n - i < BATCH ? n - i : BATCH;
+      memcpy(vals, in_buf + i * sizeof(unsigned long),
+             count * sizeof(unsigned long));
+      eval_batch(prog, vals, count);
+      out_put(vals, count * sizeof(unsigned long));
+    }
+    unsigned long used = n * sizeof(unsigned long);
+    memmove(in_buf, in_buf + used, len - used);
+    len -= used;
+  }
+  if (len != 0)
+    error();
+  out_flush();
+}
+
+/*
+ * Batch mode on several threads. The main thread reads the input into
+ * chunks cut at line (or operand) boundaries; each worker takes the oldest
+ * chunk not yet taken and turns it into output, and a writer thread puts
+ * the outputs out in input order. The chunks live in a ring of slots that
+ * doubles as the reorder buffer: a slot is refilled only once its output
+ * is written, so however far one worker falls behind, at most PAR_SLOTS
+ * chunks are held. A thread that fails (bad operand, no memory, a failed
+ * write) only sets failed; every thread then winds down, and the main
+ * thread reports the error once they are joined.
+ */
+#define PAR_CHUNK (1 << 18)
+#define PAR_SLOTS_PER_THREAD 4
+
+struct par_slot {
+  char *in; // PAR_CHUNK + 1 bytes, for parse_line()'s NUL
+  unsigned long in_len;
+  char *out; // Text results; binary ones are written back over in
+  unsigned long out_len;
+  unsigned long out_cap;
+  int done;
+};
+
+struct par_batch {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  struct par_slot *slots;
+  unsigned long nslots;
+  unsigned long read_seq;  // Chunks read so far
+  unsigned long work_seq;  // Chunks taken by workers
+  unsigned long write_seq; // Chunks written
+  int eof;
+  int failed;
+  int binary;
+  struct chain_prog *prog;
+};
+
+// Called with b->lock held.
+void par_fail(struct par_batch *b) {
+  b->failed = 1;
+  pthread_cond_broadcast(&b->cond);
+}
+
+// -1 if a line cannot be read or there is no memory for the output.
+int par_text(struct par_batch *b, struct par_slot *slot) {
+  unsigned long vals[BATCH];
+  unsigned long nvals = 0;
+  char *p = slot->in;
+  char *end = slot->in + slot->in_len;
+  slot->out_len = 0;
+  while (p < end) {
+    char *nl = memchr(p, '\n', end - p);
+    if (nl == NULL)
+      nl = end; // The unterminated last line of the input
+    if (parse_line(p, nl, &vals[nvals++]) < 0)
+      return -1;
+    p = nl + 1;
+    if (nvals == BATCH || p >= end) {
+      if (slot->out_len + nvals * 21 > slot->out_cap) {
+        char *out = realloc(slot->out, slot->out_cap * 2 + nvals * 21);
+        if (out == NULL)
+          return -1;
+        slot->out = out;
+        slot->out_cap = slot->out_cap * 2 + nvals * 21;
+      }
+      eval_batch(b->prog, vals, nvals);
+      for (unsigned long i = 0; i < nvals; i++)
+        slot->out_len += format_result(slot->out + slot->out_len, vals[i]);
+      nvals = 0;
+    }
+  }
+  return 0;
+}
+
+void *par_worker(void *arg) {
+  struct par_batch *b = arg;
+  pthread_mutex_lock(&b->lock);
+  while (1) {
+    while (b->work_seq == b->read_seq && !b->eof && !b->failed)
+      pthread_cond_wait(&b->cond, &b->lock);
+    if (b->work_seq == b->read_seq || b->failed)
+      break;
+    struct par_slot *slot = &b->slots[b->work_seq++ % b->nslots];
+    pthread_mutex_unlock(&b->lock);
+    int ok = 1;
+    if (b->binary)
+      eval_batch(b->prog, (unsigned long *)slot->in,
+                 slot->in_len / sizeof(unsigned long));
+    else
+      ok = par_text(b, slot) == 0;
+    pthread_mutex_lock(&b->lock);
+    if (!ok) {
+      par_fail(b);
+      break;
+    }
+    slot->done = 1;
+    pthread_cond_broadcast(&b->cond);
+  }
+  pthread_mutex_unlock(&b->lock);
+  return NULL;
+}
+
+void *par_writer(void *arg) {
+  struct par_batch *b = arg;
+  pthread_mutex_lock(&b->lock);
+  while (1) {
+    struct par_slot *slot = &b->slots[b->write_seq % b->nslots];
+    while ((b->write_seq < b->read_seq ? !slot->done : !b->eof) &&
+           !b->failed)
+      pthread_cond_wait(&b->cond, &b->lock);
+    if (b->write_seq == b->read_seq || b->failed)
+      break;
+    pthread_mutex_unlock(&b->lock);
+    int failed = b->binary ? write_full(1, slot->in, slot->in_len)
+                           : write_full(1, slot->out, slot->out_len);
+    pthread_mutex_lock(&b->lock);
+    if (failed) {
+      par_fail(b);
+      break;
+    }
+    slot->done = 0;
+    b->write_seq++;
+    pthread_cond_broadcast(&b->cond);
+  }
+  pthread_mutex_unlock(&b->lock);
+  return NULL;
+}
+
+void batch_parallel(struct chain_prog *prog, int binary, int threads) {
+  struct par_batch b = {0};
+  pthread_mutex_init(&b.lock, NULL);
+  pthread_cond_init(&b.cond, NULL);
+  b.nslots = threads * PAR_SLOTS_PER_THREAD;
+  b.binary = binary;
+  b.prog = prog;
+  if ((b.slots = calloc(b.nslots, sizeof(struct par_slot))) == NULL)
+    error();
+  for (unsigned long i = 0; i < b.nslots; i++)
+    if ((b.slots[i].in = malloc(PAR_CHUNK + 1)) == NULL)
+      error();
+  pthread_t *tids = malloc((threads + 1) * sizeof(pthread_t));
+  if (tids == NULL || pthread_create(&tids[0], NULL, par_writer, &b) != 0)
+    error();
+  for (int i = 1; i <= threads; i++)
+    if (pthread_create(&tids[i], NULL, par_worker, &b) != 0)
+      error();
+
+  // Whatever follows the last boundary of a chunk starts the next one.
+  char *carry = malloc(PAR_CHUNK);
+  unsigned long carry_len = 0;
+  int eof = 0;
+  if (carry == NULL)
+    error();
+  while (!eof) {
+    pthread_mutex_lock(&b.lock);
+    while (b.read_seq - b.write_seq == b.nslots && !b.failed)
+      pthread_cond_wait(&b.cond, &b.lock);
+    int failed = b.failed;
+    pthread_mutex_unlock(&b.lock);
+    if (failed)
+      break;
+    struct par_slot *slot = &b.slots[b.read_seq % b.nslots];
+    unsigned long len = carry_len;
+    memcpy(slot->in, carry, carry_len);
+    while (len < PAR_CHUNK) {
+      ssize_t n = read(0, slot->in + len, PAR_CHUNK - len);
+      if (n < 0)
+        error();
+      if (n == 0) {
+        eof = 1;
+        break;
+      }
+      len += n;
+    }
+    unsigned long cut = len;
+    if (binary)
+      cut -= len % sizeof(unsigned long);
+    else if (!eof) {
+      char *nl = memrchr(slot->in, '\n', len);
+      if (nl == NULL)
+        error(); // A line longer than a chunk
+      cut = nl + 1 - slot->in;
+    }
+    if (eof && cut != len)
+      error(); // Binary input that is not whole operands
+    carry_len = len - cut;
+    memcpy(carry, slot->in + cut, carry_len);
+    slot->in_len = cut;
+    pthread_mutex_lock(&b.lock);
+    if (cut > 0)
+      b.read_seq++;
+    b.eof = eof;
+    pthread_cond_broadcast(&b.cond);
+    pthread_mutex_unlock(&b.lock);
+  }
+  for (int i = 0; i <= threads; i++)
+    pthread_join(tids[i], NULL);
+  if (b.failed)
+    error();
+}
+
+// Threads for batch mode: OPS_THREADS, or one per CPU.
+int batch_threads() {
+  char *env = getenv("OPS_THREADS");
+  long threads = env != NULL ? atol(env) : sysconf(_SC_NPROCESSORS_ONLN);
+  return threads > 0 ? threads : 1;
+}
+
+// Run argv[0, argc) over stdin; the last argument may be "-" or "-b".
+void batch_main(int argc, char *argv[]) {
+  int binary = 0;
+  if (strcmp(argv[argc - 1], "-b") == 0 || strcmp(argv[argc - 1], "-") == 0)
+    binary = strcmp(argv[--argc], "-b") == 0;
+  int *ops = malloc(argc * sizeof(int));
+  if (ops == NULL)
+    error();
+  for (int i = 0; i < argc; i++) {
+    if ((ops[i] = chain_op(argv[i])) < 0 ||
+        (i > 0 && access(argv[i], X_OK) < 0))
+      error();
+  }
+  struct chain_prog *prog = chain_compile(ops, argc);
+  if (prog == NULL)
+    error();
+  chain_jit(prog); // Or stay with the interpreter
+  int threads = batch_threads();
+  if (threads > 1)
+    batch_parallel(prog, binary, threads);
+  else if (binary)
+    batch_binary(prog);
+  else
+    batch_text(prog);
+  exit(0);
+}
+
+/*
+ * The daemon protocol, in native byte order. A request is a struct
+ * ops_request, nops operation codes (OP_DOUBLE, ...) one byte each, then
+ * count 8-byte operands; the reply is the count results, written once the
+ * whole request has been read, so a client may send it all before reading.
+ * count is at most OPS_MAX_COUNT; larger inputs go as several requests. Any
+ * number of requests may follow on one connection. A malformed request
+ * closes the connection without a reply.
+ * Connections are served by a pool of threads, each accepting and serving
+ * one connection at a time; results are those of batch mode.
+ */
+#define OPS_MAGIC 0x3153504f // "OPS1"
+#define OPS_MAX_OPS 4096
+#define OPS_MAX_COUNT (1UL << 22) // 32 MiB of operands
+
+struct ops_request {
+  unsigned int magic;
+  unsigned int nops;
+  unsigned long count;
+};
+
+int daemon_connect(const char *sock_path) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(sock_path) >= sizeof(addr.sun_path))
+    return -1;
+  strcpy(addr.sun_path, sock_path);
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return -1;
+  // Anyone may have bound the path; only our own daemon is trusted.
+  struct ucred cred;
+  socklen_t len = sizeof(cred);
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0 ||
+      cred.uid != getuid()) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// The daemon's socket, or NULL if there is none.
+char *daemon_path(char *buf, unsigned long size) {
+  char *env = getenv("OPS_SOCKET");
+  if (env != NULL)
+    return *env != '\0' ? env : NULL;
+  env = getenv("XDG_RUNTIME_DIR");
+  if (env == NULL || *env == '\0' ||
+      snprintf(buf, size, "%s/ops.sock", env) >= (int)size)
+    return NULL;
+  return buf;
+}
+
+// Serve requests on conn until it closes or sends one that is malformed.
+void daemon_serve(int conn) {
+  struct ops_request req;
+  unsigned char codes[OPS_MAX_OPS];
+  int ops[OPS_MAX_OPS];
+  int last_ops[OPS_MAX_OPS];
+  int last_nops = -1;
+  struct chain_prog *prog = NULL;
+  unsigned long *vals = NULL;
+  unsigned long vals_cap = 0;
+  while (read_full(conn, &req, sizeof(req)) == 0) {
+    if (req.magic != OPS_MAGIC || req.nops == 0 || req.nops > OPS_MAX_OPS ||
+        req.count > OPS_MAX_COUNT || read_full(conn, codes, req.nops) < 0)
+      break;
+    unsigned int i = 0;
+    while (i < req.nops && codes[i] < OP_COUNT) {
+      ops[i] = codes[i];
+      i++;
+    }
+    if (i < req.nops)
+      break;
+    // Scripts tend to send the same chain over and over.
+    if (last_nops != (int)req.nops ||
+        memcmp(ops, last_ops, req.nops * sizeof(int)) != 0) {
+      chain_free(prog);
+      last_nops = -1;
+      if ((prog = chain_compile(ops, req.nops)) == NULL)
+        break;
+      chain_jit(prog);
+      memcpy(last_ops, ops, req.nops * sizeof(int));
+      last_nops = req.nops;
+    }
+    // Read everything first: a client writing the whole request before it
+    // reads would otherwise block us on a full socket, and we it.
+    if (req.count > vals_cap) {
+      unsigned long *grown = realloc(vals, req.count * sizeof(unsigned long));
+      if (grown == NULL)
+        break;
+      vals = grown;
+      vals_cap = req.count;
+    }
+    if (read_full(conn, vals, req.count * sizeof(unsigned long)) < 0)
+      break;
+    for (unsigned long i = 0; i < req.count; i += BATCH)
+      eval_batch(prog, vals + i, req.count - i < BATCH ? req.count - i : BATCH);
+    if (write_full(conn, vals, req.count * sizeof(unsigned long)) < 0)
+      break;
+  }
+  free(vals);
+  chain_free(prog);
+  close(conn);
+}
+
+/*
+ * Every worker accepts on the listening socket and serves what it gets. Out
+ * of descriptors or memory it waits a little for connections to close;
+ * any other failure of accept ends the daemon.
+ */
+void *daemon_worker(void *arg) {
+  int lfd = *(int *)arg;
+  while (1) {
+    int conn = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+    if (conn >= 0)
+      daemon_serve(conn);
+    else if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS ||
+             errno == ENOMEM)
+      usleep(100000);
+    else if (errno != EINTR && errno != ECONNABORTED)
+      error();
+  }
+  return NULL;
+}
+
+void daemon_main(char *sock_path, int threads) {
+  if (threads <= 0)
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (threads <= 0)
+    threads = 1;
+  signal(SIGPIPE, SIG_IGN); // A client gone mid-reply only ends its own
+
+  int lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (lfd < 0 || strlen(sock_path) >= sizeof(addr.sun_path))
+    error();
+  strcpy(addr.sun_path, sock_path);
+  // Only a stale socket of our own is replaced: one nothing answers on.
+  struct stat st;
+  if (lstat(sock_path, &st) == 0) {
+    int fd;
+    if (!S_ISSOCK(st.st_mode) || st.st_uid != getuid() ||
+        (fd = daemon_connect(sock_path)) >= 0)
+      error();
+    unlink(sock_path);
+  }
+  // Only our user may connect.
+  mode_t mask = umask(0077);
+  int bound = bind(lfd, (struct sockaddr *)&addr, sizeof(addr));
+  umask(mask);
+  if (bound < 0 || listen(lfd, 128) < 0)
+    error();
+
+  for (int i = 1; i < threads; i++) {
+    pthread_t worker;
+    if (pthread_create(&worker, NULL, daemon_worker, &lfd) != 0)
+      error();
+  }
+  daemon_worker(&lfd);
+}
+
+// Apply ops[0, nops) to *operand through the daemon; -1 if there is none.
+int daemon_eval(const int *ops, int nops, unsigned long *operand) {
+  char buf[4096];
+  char *sock_path = daemon_path(buf, sizeof(buf));
+  if (sock_path == NULL || nops > OPS_MAX_OPS)
+    return -1;
+  int fd = daemon_connect(sock_path);
+  if (fd < 0)
+    return -1;
+  char msg[sizeof(struct ops_request) + OPS_MAX_OPS + sizeof(unsigned long)];
+  struct ops_request req = {OPS_MAGIC, nops, 1};
+  memcpy(msg, &req, sizeof(req));
+  for (int i = 0; i < nops; i++)
+    msg[sizeof(req) + i] = ops[i];
+  memcpy(msg + sizeof(req) + nops, operand, sizeof(unsigned long));
+  int ret = write_full(fd, msg, sizeof(req) + nops + sizeof(unsigned long));
+  if (ret == 0)
+    ret = read_full(fd, operand, sizeof(unsigned long));
+  close(fd);
+  return ret;
+}
+
+int main(int argc, char *argv[]) {
+  char *cache_path = getenv("OPS_CACHE");
+  if (cache_path != NULL && *cache_path != '\0' &&
+      (cache = chain_cache_open(cache_path, CACHE_SLOTS)) == NULL)
+    error();
+  int op = chain_op(argv[0]);
+  if (op < 0 && argc == 2 && strcmp(argv[1], "--cache-stats") == 0) {
+    unsigned long hits = 0, misses = 0;
+    if (cache == NULL)
+      error();
+    chain_cache_stats(cache, &hits, &misses);
+    printf("%lu hits, %lu misses\n", hits, misses);
+    exit(0);
+  }
+  if (op < 0 && argc > 1 && strcmp(argv[1], "--daemon") == 0) {
+    // Usage: ops --daemon [--socket SOCK] [--threads N]
+    char buf[4096];
+    char *sock_path = daemon_path(buf, sizeof(buf));
+    int threads = 0;
+    for (int i = 2; i < argc; i++) {
+      if (strcmp(argv[i], "--socket") == 0 && i + 1 < argc)
+        sock_path = argv[++i];
+      else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+        threads = atoi(argv[++i]);
+      else
+        error();
+    }
+    if (sock_path == NULL)
+      error();
+    daemon_main(sock_path, threads);
+  }
+  if (op < 0 && argc > 1 && (op = chain_op(argv[1])) >= 0) {
+    argv++;
+    argc--;
+  }
+  if (op < 0)
+    error();
+  if (argc == 1 || chain_op(argv[argc - 1]) >= 0 ||
+      strcmp(argv[argc - 1], "-") == 0 || strcmp(argv[argc - 1], "-b") == 0)
+    batch_main(argc, argv);
+  char *endptr;
+  unsigned long output = strtoul(argv[argc - 1], &endptr, 10);
+  if (*endptr != '\0')
+    error();
+
+  // The standalone program would exec argv[i] only to have it do this.
+  int *ops = malloc(argc * sizeof(int));
+  if (ops == NULL)
+    error();
+  ops[0] = op;
+  int i = 1;
+  while (i < argc - 1 && (ops[i] = chain_op(argv[i])) >= 0 &&
+         access(argv[i], X_OK) == 0)
+    i++;
+  struct chain_prog *prog;
+  if (cache != NULL) {
+    if ((prog = chain_compile(ops, i)) == NULL)
+      error();
+    chain_cache_eval(cache, prog, &output, 1);
+  } else if (daemon_eval(ops, i, &output) < 0) {
+    for (int j = 0; j < i; j++)
+      output = chain_apply(ops[j], output);
+  }
+  if (i == argc - 1) {
+    printf("%lu\n", output);
+    exit(1);
+  }
+  char result[32];
+  sprintf(result, "%lu", output);
+  argv[argc - 1] = result;
+  if (execv(argv[i], argv + i) < 0)
+    error();
+  return 0;
+}
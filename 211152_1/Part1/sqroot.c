@@ -1,4 +1,9 @@
-#include <math.h>
+/*
+ * sqroot, rounding with the same routine as ops and the chain kernels.
+ *
+ *   gcc -O2 -o sqroot sqroot.c chain.c -lm
+ */
+#include "chain.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -15,7 +20,7 @@ int main(int argc, char *argv[]) {
     printf("Unable to execute\n");
     exit(1);
   }
-  unsigned long output = round(sqrt(operand));
+  unsigned long output = chain_sqrt_round(operand);
   if (argc == 2) {
     printf("%lu\n", output);
     exit(1);
@@ -0,0 +1,352 @@
+/*
+ * Benchmark harness for myDU.
+ *
+ *   gcc -O2 -o myDU myDU.c mydu.c -lpthread
+ *   gcc -O2 -o bench_myDU bench_myDU.c
+ *   ./bench_myDU [--myDU PATH] [--scale PCT] [--keep] [SHAPE...]
+ *
+ * Generates reproducible trees under a fresh temp dir (SHAPE is any of
+ * wide, deep, balanced; all three by default):
+ *   wide      1M files in one directory
+ *   deep      10k nested directories with a file at every level
+ *   balanced  fan-out 8, depth 4, 16 files per directory, with hardlinks,
+ *             symlinks to files and symlinks to a shared directory
+ * --scale shrinks the file and level counts to PCT percent.
+ *
+ * For each tree myDU runs in readdir order and with --inode-order, once
+ * after dropping the page cache (when permitted) and three times warm. It
+ * reports entries/sec of the best warm run, syscalls per entry counted by
+ * tracing a separate run with ptrace, and the peak RSS of the myDU process,
+ * and times `du -sb` on the same tree. myDU follows symlinks and counts
+ * hardlinks at each name, so its totals can legitimately exceed du's.
+ */
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ptrace.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+void error() {
+  printf("Unable to execute\n");
+  exit(1);
+}
+
+unsigned long scale = 100;
+unsigned long lcg_state = 211152;
+
+unsigned long lcg() {
+  lcg_state = lcg_state * 6364136223846793005UL + 1442695040888963407UL;
+  return lcg_state >> 33;
+}
+
+unsigned long scaled(unsigned long n) {
+  n = n * scale / 100;
+  return n ? n : 1;
+}
+
+void make_file(int dfd, char *name) {
+  int fd = openat(dfd, name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  // Sparse files: sizes are what myDU sums, no data needs writing.
+  if (fd < 0 || ftruncate(fd, lcg() % 65536) < 0)
+    error();
+  close(fd);
+}
+
+int make_dir(int dfd, char *name) {
+  if (mkdirat(dfd, name, 0755) < 0)
+    error();
+  int fd = openat(dfd, name, O_RDONLY | O_DIRECTORY);
+  if (fd < 0)
+    error();
+  return fd;
+}
+
+unsigned long gen_wide(int root) {
+  int dfd = make_dir(root, "wide");
+  unsigned long n = scaled(1000000);
+  char name[32];
+  for (unsigned long i = 0; i < n; i++) {
+    sprintf(name, "f%lu", i);
+    make_file(dfd, name);
+  }
+  close(dfd);
+  return n;
+}
+
+unsigned long gen_deep(int root) {
+  int dfd = make_dir(root, "deep");
+  unsigned long n = scaled(10000);
+  for (unsigned long i = 0; i < n; i++) {
+    make_file(dfd, "f");
+    int next = make_dir(dfd, "d");
+    close(dfd);
+    dfd = next;
+  }
+  close(dfd);
+  return 2 * n;
+}
+
+unsigned long gen_balanced_dir(int dfd, int depth, char *shared_rel) {
+  unsigned long entries = 0;
+  unsigned long nfiles = scaled(16);
+  char name[32];
+  for (unsigned long i = 0; i < nfiles; i++) {
+    sprintf(name, "f%lu", i);
+    make_file(dfd, name);
+  }
+  entries += nfiles;
+  if (linkat(dfd, "f0", dfd, "hardlink", 0) < 0 ||
+      symlinkat("f0", dfd, "symlink") < 0)
+    error();
+  entries += 2;
+  if (depth == 0) {
+    if (shared_rel != NULL && lcg() % 8 == 0) {
+      if (symlinkat(shared_rel, dfd, "shared") < 0)
+        error();
+      entries++;
+    }
+    return entries;
+  }
+  for (int i = 0; i < 8; i++) {
+    sprintf(name, "d%d", i);
+    int cfd = make_dir(dfd, name);
+    char rel[256];
+    sprintf(rel, "../%s", shared_rel);
+    entries += 1 + gen_balanced_dir(cfd, depth - 1, rel);
+    close(cfd);
+  }
+  return entries;
+}
+
+unsigned long gen_balanced(int root) {
+  int dfd = make_dir(root, "balanced");
+  int sfd = make_dir(dfd, "shared");
+  unsigned long entries = 1 + gen_balanced_dir(sfd, 0, NULL);
+  close(sfd);
+  // Children of the root see the shared dir as "shared", one level more
+  // per step down.
+  for (int i = 0; i < 8; i++) {
+    char name[32];
+    sprintf(name, "d%d", i);
+    int cfd = make_dir(dfd, name);
+    entries += 1 + gen_balanced_dir(cfd, 3, "../shared");
+    close(cfd);
+  }
+  close(dfd);
+  return entries;
+}
+
+double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int drop_caches() {
+  sync();
+  int fd = open("/proc/sys/vm/drop_caches", O_WRONLY);
+  if (fd < 0)
+    return 0;
+  int ok = write(fd, "3", 1) == 1;
+  close(fd);
+  return ok;
+}
+
+/*
+ * Run argv with stdout captured, returning the wall time; the first number
+ * printed is stored in *total and the child's peak RSS (KB) in *maxrss.
+ */
+double run(char **argv, unsigned long *total, long *maxrss) {
+  int pipefd[2];
+  if (pipe(pipefd) < 0)
+    error();
+  double start = now();
+  pid_t pid = fork();
+  if (pid < 0)
+    error();
+  if (pid == 0) {
+    dup2(pipefd[1], 1);
+    close(pipefd[0]);
+    close(pipefd[1]);
+    execvp(argv[0], argv);
+    _exit(127);
+  }
+  close(pipefd[1]);
+  char out[256];
+  ssize_t len, got = 0;
+  while ((len = read(pipefd[0], out + got, sizeof(out) - 1 - got)) > 0 &&
+         got + len < (ssize_t)sizeof(out) - 1)
+    got += len;
+  if (len > 0)
+    got += len;
+  // Drain whatever else it prints (e.g. a --top report).
+  char sink[4096];
+  while (read(pipefd[0], sink, sizeof(sink)) > 0)
+    ;
+  close(pipefd[0]);
+  out[got] = '\0';
+
+  int status;
+  struct rusage ru;
+  if (wait4(pid, &status, 0, &ru) < 0)
+    error();
+  double secs = now() - start;
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    error();
+  *total = strtoul(out, NULL, 10);
+  *maxrss = ru.ru_maxrss;
+  return secs;
+}
+
+/*
+ * Count the syscalls made by argv and every process it forks, by stopping
+ * each one at syscall entry with ptrace.
+ */
+unsigned long count_syscalls(char **argv) {
+  pid_t pid = fork();
+  if (pid < 0)
+    error();
+  if (pid == 0) {
+    int devnull = open("/dev/null", O_WRONLY);
+    dup2(devnull, 1);
+    ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+    raise(SIGSTOP);
+    execvp(argv[0], argv);
+    _exit(127);
+  }
+  int status;
+  if (waitpid(pid, &status, 0) < 0 ||
+      ptrace(PTRACE_SETOPTIONS, pid, NULL,
+             PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACEFORK |
+                 PTRACE_O_TRACEVFORK | PTRACE_O_TRACECLONE |
+                 PTRACE_O_EXITKILL) < 0)
+    return 0;
+  ptrace(PTRACE_SYSCALL, pid, NULL, NULL);
+
+  unsigned long count = 0;
+  pid_t p;
+  while ((p = waitpid(-1, &status, __WALL)) > 0) {
+    if (!WIFSTOPPED(status))
+      continue;
+    int sig = WSTOPSIG(status);
+    int deliver = 0;
+    if (sig == (SIGTRAP | 0x80)) {
+      struct __ptrace_syscall_info info;
+      if (ptrace(PTRACE_GET_SYSCALL_INFO, p, sizeof(info), &info) > 0 &&
+          info.op == PTRACE_SYSCALL_INFO_ENTRY)
+        count++;
+    } else if (sig != SIGTRAP && sig != SIGSTOP) {
+      deliver = sig; // A real signal, not a ptrace event or new-child stop
+    }
+    ptrace(PTRACE_SYSCALL, p, NULL, (void *)(long)deliver);
+  }
+  return count;
+}
+
+void bench_shape(char *mydu, char *shape, char *dir, unsigned long entries) {
+  char *modes[] = {"", "--inode-order"};
+  unsigned long total = 0;
+  long maxrss = 0;
+  for (int m = 0; m < 2; m++) {
+    char *argv[4];
+    int argc = 0;
+    argv[argc++] = mydu;
+    if (modes[m][0] != '\0')
+      argv[argc++] = modes[m];
+    argv[argc++] = dir;
+    argv[argc] = NULL;
+
+    char cold[16] = "-";
+    if (drop_caches())
+      sprintf(cold, "%.3f", run(argv, &total, &maxrss));
+    double warm = 0;
+    for (int i = 0; i < 3; i++) {
+      double secs = run(argv, &total, &maxrss);
+      if (i == 0 || secs < warm)
+        warm = secs;
+    }
+    unsigned long calls = count_syscalls(argv);
+    printf("%-9s %9lu  %-14s %8s %8.3f %12.0f %9.2f %10ld  %lu\n", shape,
+           entries, m ? "inode-order" : "readdir", cold, warm, entries / warm,
+           (double)calls / entries, maxrss, total);
+  }
+
+  char *du_argv[] = {"du", "-sb", dir, NULL};
+  char cold[16] = "-";
+  if (drop_caches())
+    sprintf(cold, "%.3f", run(du_argv, &total, &maxrss));
+  double warm = run(du_argv, &total, &maxrss);
+  printf("%-9s %9lu  %-14s %8s %8.3f %12.0f %9s %10ld  %lu\n", shape, entries,
+         "du -sb", cold, warm, entries / warm, "-", maxrss, total);
+}
+
+int main(int argc, char *argv[]) {
+  char *mydu = "./myDU";
+  int keep = 0;
+  int want[3] = {0, 0, 0};
+  int any = 0;
+  char *names[3] = {"wide", "deep", "balanced"};
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--myDU") == 0 && i + 1 < argc) {
+      mydu = argv[++i];
+    } else if (strcmp(argv[i], "--scale") == 0 && i + 1 < argc) {
+      scale = strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--keep") == 0) {
+      keep = 1;
+    } else {
+      int s = 0;
+      while (s < 3 && strcmp(argv[i], names[s]) != 0)
+        s++;
+      if (s == 3)
+        error();
+      want[s] = any = 1;
+    }
+  }
+  if (!any)
+    want[0] = want[1] = want[2] = 1;
+  if (access(mydu, X_OK) < 0)
+    error();
+
+  char tmp[] = "/tmp/mydu-bench.XXXXXX";
+  if (mkdtemp(tmp) == NULL)
+    error();
+  int root = open(tmp, O_RDONLY | O_DIRECTORY);
+  if (root < 0)
+    error();
+  fprintf(stderr, "generating trees in %s\n", tmp);
+
+  printf("%-9s %9s  %-14s %8s %8s %12s %9s %10s  %s\n", "shape", "entries",
+         "mode", "cold(s)", "warm(s)", "entries/s", "sys/entry", "maxrss(KB)",
+         "total");
+  for (int s = 0; s < 3; s++) {
+    if (!want[s])
+      continue;
+    lcg_state = 211152 + s;
+    unsigned long entries = s == 0   ? gen_wide(root)
+                            : s == 1 ? gen_deep(root)
+                                     : gen_balanced(root);
+    char dir[64];
+    sprintf(dir, "%s/%s", tmp, names[s]);
+    bench_shape(mydu, names[s], dir, entries);
+    fflush(stdout);
+  }
+  close(root);
+
+  if (keep) {
+    fprintf(stderr, "kept %s\n", tmp);
+  } else {
+    char *rm_argv[] = {"rm", "-rf", tmp, NULL};
+    unsigned long unused;
+    long unused_rss;
+    run(rm_argv, &unused, &unused_rss);
+  }
+  return 0;
+}
@@ -1,13 +1,22 @@
+#define _GNU_SOURCE
+#include "mydu.h"
 #include <dirent.h>
 #include <errno.h>
-#include <locale.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/fanotify.h>
+#include <sys/inotify.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
-#include <sys/ucontext.h>
-#include <sys/wait.h>
+#include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
 
 void error() {
@@ -15,192 +24,1416 @@ void error() {
   exit(1);
 }
 
-unsigned long symlink_main(char *basedir) {
-  struct stat check_sym;
-  stat(basedir, &check_sym);
-  if (S_ISLNK(check_sym.st_mode)) {
-    char buf[10000];
-    for (int i = 0; i < 10000; i++) {
-      buf[i] = '\0';
+/*
+ * Top-N report. Two bounded min-heaps, one for directories (by subtree
+ * total) and one for regular files, are filled from the scan callbacks: a
+ * directory is offered once its total is known, so nothing beyond the
+ * traversal stack and the heaps is kept. Worker threads feed the same heaps,
+ * serialised by a mutex; candidates no larger than the current minimum are
+ * rejected without taking it. A path is copied before the lock is taken and
+ * only its pointer is swapped under it.
+ */
+#define TOP_PATH_MAX 4096 // Read size for snapshot paths; longer ones grow
+
+struct top_item {
+  unsigned long size;
+  unsigned long slot; // Index into the path array
+};
+
+struct top_heap {
+  pthread_mutex_t lock;
+  unsigned long n;
+  unsigned long cap;
+  struct top_item *items;
+  char **paths;
+};
+
+unsigned long top_n = 0;
+struct top_heap *top_dirs = NULL;
+struct top_heap *top_files = NULL;
+
+struct top_heap *top_alloc(unsigned long cap) {
+  unsigned long len = sizeof(struct top_heap) +
+                      cap * (sizeof(struct top_item) + sizeof(char *));
+  struct top_heap *heap = calloc(1, len);
+  if (heap == NULL)
+    error();
+  pthread_mutex_init(&heap->lock, NULL);
+  heap->cap = cap;
+  heap->items = (struct top_item *)(heap + 1);
+  heap->paths = (char **)(heap->items + cap);
+  return heap;
+}
+
+void top_sift_down(struct top_heap *heap, unsigned long i) {
+  struct top_item *items = heap->items;
+  while (1) {
+    unsigned long min = i, l = 2 * i + 1, r = 2 * i + 2;
+    if (l < heap->n && items[l].size < items[min].size)
+      min = l;
+    if (r < heap->n && items[r].size < items[min].size)
+      min = r;
+    if (min == i)
+      return;
+    struct top_item tmp = items[i];
+    items[i] = items[min];
+    items[min] = tmp;
+    i = min;
+  }
+}
+
+void top_offer(struct top_heap *heap, unsigned long size, const char *path) {
+  if (__atomic_load_n(&heap->n, __ATOMIC_RELAXED) == heap->cap &&
+      size <= __atomic_load_n(&heap->items[0].size, __ATOMIC_RELAXED))
+    return;
+  char *copy = strdup(path);
+  if (copy == NULL)
+    error();
+  pthread_mutex_lock(&heap->lock);
+
+  struct top_item *items = heap->items;
+  unsigned long slot;
+  if (heap->n < heap->cap) {
+    unsigned long i = heap->n++;
+    slot = i;
+    while (i > 0 && items[(i - 1) / 2].size > size) {
+      items[i] = items[(i - 1) / 2];
+      i = (i - 1) / 2;
     }
-    if (readlink(basedir, buf, 10000) == 10000)
+    items[i].size = size;
+    items[i].slot = slot;
+  } else if (size > items[0].size) {
+    slot = items[0].slot;
+    items[0].size = size;
+    top_sift_down(heap, 0);
+  } else {
+    pthread_mutex_unlock(&heap->lock);
+    free(copy);
+    return;
+  }
+  char *old = heap->paths[slot];
+  heap->paths[slot] = copy;
+
+  pthread_mutex_unlock(&heap->lock);
+  free(old);
+}
+
+int top_item_cmp(const void *a, const void *b) {
+  unsigned long x = ((struct top_item *)a)->size;
+  unsigned long y = ((struct top_item *)b)->size;
+  return x < y ? 1 : x > y ? -1 : 0;
+}
+
+void top_report(struct top_heap *heap, char *prefix, char *suffix) {
+  qsort(heap->items, heap->n, sizeof(struct top_item), top_item_cmp);
+  for (unsigned long i = 0; i < heap->n; i++)
+    printf("%s%lu\t%s%s\n", prefix, heap->items[i].size,
+           heap->paths[heap->items[i].slot], suffix);
+}
+
+// Entries reached through symlinks are counted but not listed.
+int top_on_dir(const struct mydu_entry *entry, void *arg) {
+  (void)arg;
+  if (entry->depth > 0 && !(entry->flags & MYDU_LINKED))
+    top_offer(top_dirs, entry->size, entry->path);
+  return 0;
+}
+
+int top_on_file(const struct mydu_entry *entry, void *arg) {
+  (void)arg;
+  if (!(entry->flags & MYDU_LINKED))
+    top_offer(top_files, entry->size, entry->path);
+  return 0;
+}
+
+/*
+ * Per-extension totals (--metrics ext), filled from the file callback with
+ * the usage the scan already has. The extension is what follows the last
+ * '.' of the name, unless the name starts there; files reached through
+ * symlinks count, so the table adds up to the scan's file totals.
+ */
+#define EXT_MAX 16 // Longer suffixes count as no extension
+#define EXT_BUCKETS 1024
+
+struct ext_total {
+  struct ext_total *next;
+  struct mydu_usage usage;
+  char ext[EXT_MAX + 1];
+};
+
+struct ext_total *ext_table[EXT_BUCKETS];
+unsigned long ext_count = 0;
+pthread_mutex_t ext_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void ext_add(const char *path, const struct mydu_usage *usage) {
+  const char *name = strrchr(path, '/');
+  name = name != NULL ? name + 1 : path;
+  const char *dot = strrchr(name, '.');
+  const char *ext = "";
+  if (dot != NULL && dot != name && strlen(dot + 1) <= EXT_MAX)
+    ext = dot + 1;
+  unsigned long h = 5381;
+  for (const char *p = ext; *p != '\0'; p++)
+    h = h * 33 + (unsigned char)*p;
+  h %= EXT_BUCKETS;
+
+  pthread_mutex_lock(&ext_lock);
+  struct ext_total *e = ext_table[h];
+  while (e != NULL && strcmp(e->ext, ext) != 0)
+    e = e->next;
+  if (e == NULL) {
+    if ((e = calloc(1, sizeof(struct ext_total))) == NULL)
       error();
-    for (int i = 9999; i >= 0; i--) {
-      if (basedir[i] == '/')
-        break;
-      basedir[i] = '\0';
-    }
-    strcat(basedir, buf);
-    return symlink_main(basedir);
+    strcpy(e->ext, ext);
+    e->next = ext_table[h];
+    ext_table[h] = e;
+    ext_count++;
   }
-  DIR *maindir = opendir(basedir);
-  if (maindir == NULL)
+  e->usage.size += usage->size;
+  e->usage.alloc += usage->alloc;
+  e->usage.files += usage->files;
+  pthread_mutex_unlock(&ext_lock);
+}
+
+int ext_cmp(const void *a, const void *b) {
+  unsigned long x = (*(struct ext_total **)a)->usage.size;
+  unsigned long y = (*(struct ext_total **)b)->usage.size;
+  return x < y ? 1 : x > y ? -1 : 0;
+}
+
+// One line per extension, largest first: size, allocated, files, extension.
+void ext_report() {
+  struct ext_total **all = malloc(ext_count * sizeof(struct ext_total *) + 1);
+  if (all == NULL)
     error();
+  unsigned long n = 0;
+  for (int i = 0; i < EXT_BUCKETS; i++)
+    for (struct ext_total *e = ext_table[i]; e != NULL; e = e->next)
+      all[n++] = e;
+  qsort(all, n, sizeof(struct ext_total *), ext_cmp);
+  for (unsigned long i = 0; i < n; i++)
+    printf("%lu\t%lu\t%lu\t%s%s\n", all[i]->usage.size, all[i]->usage.alloc,
+           all[i]->usage.files, all[i]->ext[0] ? "." : "",
+           all[i]->ext[0] ? all[i]->ext : "(none)");
+  free(all);
+}
+
+int want_ext = 0;
+
+int scan_on_file(const struct mydu_entry *entry, void *arg) {
+  if (top_n > 0)
+    top_on_file(entry, arg);
+  if (want_ext)
+    ext_add(entry->path, entry->usage);
+  return 0;
+}
 
-  struct dirent *md_iter;
-  unsigned long dir_size = 0;
+/*
+ * Streaming output (--stream ndjson|binary): one record per directory,
+ * written as soon as its subtree is complete, so consumers can follow a
+ * huge scan as it goes; the root comes last. Records from all worker
+ * threads go through one 64 KiB buffer behind a mutex and reach stdout in
+ * large writes; a thread that fills it writes it out under the lock, so the
+ * others sleep rather than spin while stdout drains.
+ *
+ *   ndjson  {"path":P,"size":N,"alloc":N,"files":N,"dirs":N,"depth":N,
+ *            "flags":N} per line; '"', '\\' and control characters are
+ *           escaped, other bytes of the path are written as they are.
+ *   binary  "MDUSTRM1", then per record a u32 length of the rest of the
+ *           record, u64 size, alloc, files, dirs, u32 depth, u32 flags and
+ *           the path without its NUL, in host byte order.
+ *
+ * flags are the MYDU_* entry flags from mydu.h.
+ */
+#define STREAM_NONE 0
+#define STREAM_NDJSON 1
+#define STREAM_BINARY 2
 
-  struct stat filest;
-  stat(basedir, &filest);
-  dir_size += filest.st_size;
-  while ((md_iter = readdir(maindir)) != NULL) {
-    char fpath[5000];
-    strcpy(fpath, basedir);
-    strcat(fpath, "/");
-    strcat(fpath, md_iter->d_name);
+int stream_format = STREAM_NONE;
+char stream_buf[1 << 16];
+unsigned long stream_len = 0;
+pthread_mutex_t stream_lock = PTHREAD_MUTEX_INITIALIZER;
 
-    if (strcmp(md_iter->d_name, ".") == 0 || strcmp(md_iter->d_name, "..") == 0)
+void stream_flush() {
+  unsigned long done = 0;
+  while (done < stream_len) {
+    ssize_t n = write(1, stream_buf + done, stream_len - done);
+    if (n < 0 && errno == EINTR)
       continue;
-    if (md_iter->d_type == DT_DIR) {
-      dir_size += symlink_main(fpath);
-    } else if (md_iter->d_type == DT_REG) {
-      struct stat filest;
-      stat(fpath, &filest);
-      dir_size += filest.st_size;
-    } else if (md_iter->d_type == DT_LNK) {
-
-      char sym_path[10000];
-      strcat(sym_path, basedir);
-      strcat(sym_path, "/");
-
-      char buf[10000];
-      for (int i = 0; i < 10000; i++) {
-        buf[i] = '\0';
-      }
-      if (readlink(fpath, buf, 10000) == 10000)
-        error();
-      strcat(sym_path, buf);
+    if (n <= 0)
+      error();
+    done += n;
+  }
+  stream_len = 0;
+}
 
-      dir_size += symlink_main(sym_path);
+void stream_put(const void *data, unsigned long len) {
+  if (stream_len + len > sizeof(stream_buf)) {
+    stream_flush();
+    if (len > sizeof(stream_buf)) {
+      memcpy(stream_buf, data, sizeof(stream_buf));
+      stream_len = sizeof(stream_buf);
+      stream_flush();
+      stream_put((const char *)data + sizeof(stream_buf),
+                 len - sizeof(stream_buf));
+      return;
     }
   }
-  return dir_size;
+  memcpy(stream_buf + stream_len, data, len);
+  stream_len += len;
 }
 
-unsigned long directory_main(char *basedir, int root) {
+void stream_json_path(const char *path) {
+  char esc[8];
+  const char *run = path;
+  for (const char *p = path;; p++) {
+    unsigned char c = *p;
+    if (c != '\0' && c >= 0x20 && c != '"' && c != '\\')
+      continue;
+    stream_put(run, p - run);
+    if (c == '\0')
+      return;
+    if (c == '"' || c == '\\')
+      sprintf(esc, "\\%c", c);
+    else
+      sprintf(esc, "\\u%04x", c);
+    stream_put(esc, strlen(esc));
+    run = p + 1;
+  }
+}
+
+void stream_record(const struct mydu_entry *entry) {
+  const struct mydu_usage *u = entry->usage;
+  pthread_mutex_lock(&stream_lock);
+  if (stream_format == STREAM_NDJSON) {
+    char tail[160];
+    stream_put("{\"path\":\"", 9);
+    stream_json_path(entry->path);
+    int n = sprintf(tail,
+                    "\",\"size\":%lu,\"alloc\":%lu,\"files\":%lu,"
+                    "\"dirs\":%lu,\"depth\":%lu,\"flags\":%d}\n",
+                    u->size, u->alloc, u->files, u->dirs, entry->depth,
+                    entry->flags);
+    stream_put(tail, n);
+  } else {
+    unsigned long plen = strlen(entry->path);
+    unsigned int len = 4 * sizeof(unsigned long) + 2 * sizeof(unsigned int) +
+                       plen;
+    unsigned long fields[4] = {u->size, u->alloc, u->files, u->dirs};
+    unsigned int tail[2] = {entry->depth, entry->flags};
+    stream_put(&len, sizeof(len));
+    stream_put(fields, sizeof(fields));
+    stream_put(tail, sizeof(tail));
+    stream_put(entry->path, plen);
+  }
+  pthread_mutex_unlock(&stream_lock);
+}
+
+/*
+ * Snapshots (--snapshot FILE) and diffs (--diff OLD NEW). A snapshot keys
+ * every directory by a 64-bit FNV-1a hash of its path relative to the scan
+ * root, so snapshots of one tree taken under different mount points still
+ * line up:
+ *
+ *   header  "MDUSNAP1", u64 record count, u64 offset of the index, u64 0
+ *   paths   NUL-terminated full paths, appended as directories complete
+ *   index   {u64 hash, u64 size, u64 path offset} per directory, by hash
+ *
+ * Writing keeps only the 24-byte index entries in memory. A diff walks
+ * both indexes in one merge pass and keeps nothing but the --top N
+ * growers and shrinkers (10 by default); paths are read back only for
+ * entries that make it into one of those heaps.
+ */
+struct snap_rec {
+  unsigned long hash;
+  unsigned long size;
+  unsigned long path_off;
+};
+
+struct snap_header {
+  char magic[8];
+  unsigned long count;
+  unsigned long index_off;
+  unsigned long pad;
+};
+
+FILE *snap_file = NULL;
+unsigned long snap_root_len = 0;
+unsigned long snap_off = sizeof(struct snap_header);
+struct snap_rec *snap_recs = NULL;
+unsigned long snap_count = 0;
+unsigned long snap_cap = 0;
+pthread_mutex_t snap_lock = PTHREAD_MUTEX_INITIALIZER;
 
-  DIR *maindir = opendir(basedir);
-  if (maindir == NULL)
+unsigned long snap_hash(const char *rel) {
+  unsigned long h = 14695981039346656037UL;
+  for (; *rel != '\0'; rel++)
+    h = (h ^ (unsigned char)*rel) * 1099511628211UL;
+  return h;
+}
+
+void snap_open(char *path, char *root) {
+  if ((snap_file = fopen(path, "w")) == NULL)
     error();
+  struct snap_header hdr = {"MDUSNAP1", 0, 0, 0};
+  if (fwrite(&hdr, sizeof(hdr), 1, snap_file) != 1)
+    error();
+  snap_root_len = strlen(root);
+}
 
-  struct dirent *md_iter;
-  unsigned long dir_size = 0;
+void snap_record(const struct mydu_entry *entry) {
+  unsigned long len = strlen(entry->path) + 1;
+  pthread_mutex_lock(&snap_lock);
+  if (snap_count == snap_cap) {
+    snap_cap = snap_cap ? snap_cap * 2 : 1024;
+    snap_recs = realloc(snap_recs, snap_cap * sizeof(struct snap_rec));
+    if (snap_recs == NULL)
+      error();
+  }
+  struct snap_rec *r = &snap_recs[snap_count++];
+  r->hash = snap_hash(entry->path + snap_root_len);
+  r->size = entry->size;
+  r->path_off = snap_off;
+  if (fwrite(entry->path, len, 1, snap_file) != 1)
+    error();
+  snap_off += len;
+  pthread_mutex_unlock(&snap_lock);
+}
 
-  struct stat filest;
-  stat(basedir, &filest);
-  dir_size += filest.st_size;
-  while ((md_iter = readdir(maindir)) != NULL) {
-    char fpath[5000];
-    strcpy(fpath, basedir);
-    strcat(fpath, "/");
-    strcat(fpath, md_iter->d_name);
+int snap_rec_cmp(const void *a, const void *b) {
+  unsigned long x = ((struct snap_rec *)a)->hash;
+  unsigned long y = ((struct snap_rec *)b)->hash;
+  return x < y ? -1 : x > y ? 1 : 0;
+}
 
-    if (strcmp(md_iter->d_name, ".") == 0 || strcmp(md_iter->d_name, "..") == 0)
-      continue;
-    if (md_iter->d_type == DT_DIR) {
-      dir_size += directory_main(fpath, 0);
-    } else if (md_iter->d_type == DT_REG) {
-      struct stat filest;
-      stat(fpath, &filest);
-      dir_size += filest.st_size;
-    } else if (md_iter->d_type == DT_LNK) {
-      char sym_path[10000];
-      strcat(sym_path, basedir);
-      strcat(sym_path, "/");
-
-      char buf[10000];
-      for (int i = 0; i < 10000; i++) {
-        buf[i] = '\0';
-      }
-      if (readlink(fpath, buf, 10000) == 10000)
-        error();
-      strcat(sym_path, buf);
+void snap_close() {
+  qsort(snap_recs, snap_count, sizeof(struct snap_rec), snap_rec_cmp);
+  struct snap_header hdr = {"MDUSNAP1", snap_count, snap_off, 0};
+  if (fwrite(snap_recs, sizeof(struct snap_rec), snap_count, snap_file) !=
+          snap_count ||
+      fseek(snap_file, 0, SEEK_SET) < 0 ||
+      fwrite(&hdr, sizeof(hdr), 1, snap_file) != 1 || fclose(snap_file) != 0)
+    error();
+  free(snap_recs);
+}
 
-      dir_size += symlink_main(sym_path);
+// Open a snapshot positioned at its index; *count gets the record count.
+FILE *snap_read_open(char *path, unsigned long *count) {
+  FILE *f = fopen(path, "r");
+  struct snap_header hdr;
+  if (f == NULL || fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+      memcmp(hdr.magic, "MDUSNAP1", 8) != 0 ||
+      fseek(f, hdr.index_off, SEEK_SET) < 0)
+    error();
+  *count = hdr.count;
+  return f;
+}
+
+int snap_next(FILE *f, unsigned long *left, struct snap_rec *r) {
+  if (*left == 0)
+    return 0;
+  if (fread(r, sizeof(*r), 1, f) != 1)
+    error();
+  (*left)--;
+  return 1;
+}
+
+// Offer a change to heap, reading its path from the snapshot only if needed.
+void snap_offer(struct top_heap *heap, unsigned long delta, FILE *f,
+                unsigned long path_off) {
+  if (delta == 0 || (heap->n == heap->cap && delta <= heap->items[0].size))
+    return;
+  // Paths in the snapshot are NUL-terminated and may be any length.
+  char *path = NULL;
+  unsigned long len = 0;
+  ssize_t n;
+  unsigned long got;
+  do {
+    if ((path = realloc(path, len + TOP_PATH_MAX + 1)) == NULL)
+      error();
+    if ((n = pread(fileno(f), path + len, TOP_PATH_MAX, path_off + len)) <= 0)
+      error();
+    path[len + n] = '\0';
+    got = strlen(path + len);
+    len += got;
+  } while (got == (unsigned long)n); // No NUL read yet
+  top_offer(heap, delta, path);
+  free(path);
+}
+
+void snap_diff(char *old_path, char *new_path) {
+  unsigned long old_left, new_left;
+  FILE *old = snap_read_open(old_path, &old_left);
+  FILE *new = snap_read_open(new_path, &new_left);
+  struct top_heap *grown = top_alloc(top_n);
+  struct top_heap *shrunk = top_alloc(top_n);
+  struct snap_rec o, n;
+  int have_o = snap_next(old, &old_left, &o);
+  int have_n = snap_next(new, &new_left, &n);
+  while (have_o || have_n) {
+    if (have_n && (!have_o || n.hash < o.hash)) {
+      snap_offer(grown, n.size, new, n.path_off); // New directory
+      have_n = snap_next(new, &new_left, &n);
+    } else if (have_o && (!have_n || o.hash < n.hash)) {
+      snap_offer(shrunk, o.size, old, o.path_off); // Removed directory
+      have_o = snap_next(old, &old_left, &o);
+    } else {
+      if (n.size > o.size)
+        snap_offer(grown, n.size - o.size, new, n.path_off);
+      else
+        snap_offer(shrunk, o.size - n.size, new, n.path_off);
+      have_o = snap_next(old, &old_left, &o);
+      have_n = snap_next(new, &new_left, &n);
     }
   }
+  top_report(grown, "+", "/");
+  top_report(shrunk, "-", "/");
+  exit(0);
+}
 
-  if (root)
-    write(1, &dir_size, sizeof(dir_size));
-  return dir_size;
+int root_flags = 0;
+
+int scan_on_dir(const struct mydu_entry *entry, void *arg) {
+  if (entry->depth == 0)
+    root_flags = entry->flags;
+  if (top_n > 0)
+    top_on_dir(entry, arg);
+  if (stream_format != STREAM_NONE)
+    stream_record(entry);
+  if (snap_file != NULL)
+    snap_record(entry);
+  return 0;
 }
 
-int main(int argc, char *argv[]) {
-  if (argc != 2)
+/*
+ * Instrumentation. With --progress SECS a reporter thread prints the scan's
+ * counters to stderr every SECS seconds (never, for 0) and whenever the
+ * process gets SIGUSR1; --stats prints them once more at the end, with the
+ * CPU time used. SIGUSR1 is blocked before the scan starts its workers so
+ * only the reporter, in sigtimedwait(), ever takes it; without a reporter it
+ * is ignored, so a stray SIGUSR1 never kills a scan. Comparing the time
+ * spent in syscalls with the CPU time tells a scan waiting on the disk from
+ * one burning CPU in the kernel or in myDU itself.
+ */
+struct mydu_stats stats;
+double stats_start = 0;
+double progress_secs = -1; // Below 0: no reporter
+int want_stats = 0;
+int progress_done = 0;
+pthread_t progress_thread;
+
+double stats_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+unsigned long stats_load(unsigned long *counter) {
+  return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+void stats_line() {
+  fprintf(stderr,
+          "myDU: %.1fs: %lu dirs, %lu entries, %lu stats, %lu bytes, %lu "
+          "errors; open %.2fs, read %.2fs, stat %.2fs\n",
+          stats_now() - stats_start, stats_load(&stats.dirs),
+          stats_load(&stats.entries), stats_load(&stats.stats),
+          stats_load(&stats.bytes), stats_load(&stats.errors),
+          stats_load(&stats.open_ns) / 1e9, stats_load(&stats.read_ns) / 1e9,
+          stats_load(&stats.stat_ns) / 1e9);
+}
+
+void *progress_main(void *arg) {
+  (void)arg;
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGUSR1);
+  struct timespec tick;
+  tick.tv_sec = (time_t)progress_secs;
+  tick.tv_nsec = (long)((progress_secs - tick.tv_sec) * 1e9);
+  for (;;) {
+    int sig = sigtimedwait(&set, NULL, progress_secs > 0 ? &tick : NULL);
+    if (__atomic_load_n(&progress_done, __ATOMIC_ACQUIRE))
+      return NULL;
+    if (sig == SIGUSR1 || (sig < 0 && errno == EAGAIN))
+      stats_line();
+  }
+}
+
+void stats_begin(struct mydu_opts *opts) {
+  if (progress_secs < 0)
+    signal(SIGUSR1, SIG_IGN);
+  if (progress_secs < 0 && !want_stats)
+    return;
+  opts->stats = &stats;
+  stats_start = stats_now();
+  if (progress_secs < 0)
+    return;
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGUSR1);
+  if (pthread_sigmask(SIG_BLOCK, &set, NULL) != 0 ||
+      pthread_create(&progress_thread, NULL, progress_main, NULL) != 0)
+    error();
+}
+
+void stats_end() {
+  if (progress_secs >= 0) {
+    __atomic_store_n(&progress_done, 1, __ATOMIC_RELEASE);
+    pthread_kill(progress_thread, SIGUSR1);
+    pthread_join(progress_thread, NULL);
+  }
+  if (!want_stats)
+    return;
+  stats_line();
+  struct rusage ru;
+  if (getrusage(RUSAGE_SELF, &ru) == 0)
+    fprintf(stderr, "myDU: cpu %.2fs user, %.2fs sys\n",
+            ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6,
+            ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6);
+}
+
+/*
+ * --metrics LIST picks the figures printed for DIR, in order, from size,
+ * alloc, files and dirs (see struct mydu_usage); ext adds the extension
+ * report. All of them come from the same single pass.
+ */
+#define METRIC_SIZE 0
+#define METRIC_ALLOC 1
+#define METRIC_FILES 2
+#define METRIC_DIRS 3
+
+int parse_metrics(char *list, int *metrics) {
+  char *names[] = {"size", "alloc", "files", "dirs"};
+  int n = 0;
+  for (char *tok = strtok(list, ","); tok != NULL; tok = strtok(NULL, ",")) {
+    if (strcmp(tok, "ext") == 0) {
+      want_ext = 1;
+      continue;
+    }
+    int m = 0;
+    while (m < 4 && strcmp(tok, names[m]) != 0)
+      m++;
+    if (m == 4 || n == 4)
+      error();
+    metrics[n++] = m;
+  }
+  return n;
+}
+
+// Size contributed by the symlink name in dfd, following it like a scan
+// does; 0 if it dangles.
+unsigned long symlink_size(int dfd, const char *name) {
+  struct stat target;
+  if (fstatat(dfd, name, &target, 0) < 0)
+    return 0;
+  if (!S_ISDIR(target.st_mode))
+    return target.st_size;
+  // Reached through dfd, so the link's own path may be of any length.
+  char *path = malloc(strlen(name) + 32);
+  if (path == NULL)
     error();
+  sprintf(path, "/proc/self/fd/%d/%s", dfd, name);
+  struct mydu_opts opts;
+  mydu_opts_init(&opts);
+  unsigned long total = 0;
+  mydu_scan(path, &opts, &total);
+  free(path);
+  return total;
+}
+
+/*
+ * Watch mode. One initial scan builds an in-memory node per directory holding
+ * its own size (inode, regular files and followed symlinks) and its subtree
+ * total. Filesystem events only mark the containing directory dirty; once the
+ * pending events are drained every dirty directory re-reads its own entries,
+ * reconciles its child directories, and the resulting delta is added to each
+ * ancestor. Totals are served over a Unix socket from a path hash table.
+ *
+ * Directories are opened relative to their parent's fd, as the scan does,
+ * and watched through that fd, so paths past PATH_MAX work. The top
+ * WATCH_FD_BUDGET levels of a build keep their fd while their subdirectories
+ * are built; deeper ones close it and reopen it for each next subdirectory,
+ * by path or, once that is too long, through their parents. Entries without
+ * a d_type are classified with fstatat(). A directory that cannot be watched
+ * is an error: its totals could only go stale.
+ *
+ * A followed symlink to a directory is sized by a full scan of its target
+ * whenever the directory holding the link is re-read. The target gets no
+ * node or watch of its own, so a change inside it (outside the watched tree)
+ * is only picked up once the link's directory is next dirtied; until then
+ * its totals are stale.
+ *
+ * fanotify (a filesystem mark reporting directory file handles) is used when
+ * permitted; otherwise every directory gets an inotify watch.
+ */
+struct wnode {
+  char *path;
+  struct wnode *parent;
+  struct wnode *child;
+  struct wnode *sibling;
+  struct wnode *path_next; // Chain in path_table
+  struct wnode *fh_next;   // Chain in fh_table (fanotify)
+  unsigned char *fh;       // Handle type + bytes (fanotify)
+  unsigned int fh_len;
+  unsigned long fh_hash;
+  int wd; // inotify watch descriptor
+  int seen;
+  long dirty_idx; // Index in dirty list, or -1
+  unsigned long own_size;
+  unsigned long total;
+};
+
+#define WATCH_FANOTIFY 1
+#define WATCH_INOTIFY 2
+
+int watch_mode = 0;
+int watch_fd = -1;
+int watch_mount_fd = -1;
+
+struct wnode **path_table = NULL;
+unsigned long path_table_size = 0;
+unsigned long path_table_used = 0;
+struct wnode **fh_table = NULL;
+unsigned long fh_table_size = 0;
+struct wnode **wd_table = NULL;
+unsigned long wd_table_size = 0;
+struct wnode **dirty = NULL;
+unsigned long dirty_count = 0;
+unsigned long dirty_cap = 0;
+
+unsigned long str_hash(const char *s) {
+  unsigned long h = 1469598103934665603UL; // FNV-1a
+  while (*s) {
+    h ^= (unsigned char)*s++;
+    h *= 1099511628211UL;
+  }
+  return h;
+}
 
-  char *basedir = argv[1];
-  DIR *maindir = opendir(basedir);
+unsigned long bytes_hash(const unsigned char *b, unsigned int len) {
+  unsigned long h = 1469598103934665603UL;
+  for (unsigned int i = 0; i < len; i++) {
+    h ^= b[i];
+    h *= 1099511628211UL;
+  }
+  return h;
+}
 
-  if (maindir == NULL)
+void *xcalloc(unsigned long n, unsigned long size) {
+  void *p = calloc(n, size);
+  if (p == NULL)
     error();
-  struct dirent *md_iter;
-  unsigned long dir_size = 0;
+  return p;
+}
+
+void path_table_insert(struct wnode *n) {
+  if (path_table_used * 2 >= path_table_size) {
+    unsigned long new_size = path_table_size ? path_table_size * 2 : 1024;
+    struct wnode **new_table = xcalloc(new_size, sizeof(struct wnode *));
+    for (unsigned long i = 0; i < path_table_size; i++) {
+      struct wnode *it = path_table[i];
+      while (it != NULL) {
+        struct wnode *next = it->path_next;
+        unsigned long b = str_hash(it->path) & (new_size - 1);
+        it->path_next = new_table[b];
+        new_table[b] = it;
+        it = next;
+      }
+    }
+    free(path_table);
+    path_table = new_table;
+    path_table_size = new_size;
+  }
+  unsigned long b = str_hash(n->path) & (path_table_size - 1);
+  n->path_next = path_table[b];
+  path_table[b] = n;
+  path_table_used++;
+}
+
+struct wnode *path_table_find(const char *path) {
+  if (path_table_size == 0)
+    return NULL;
+  struct wnode *it = path_table[str_hash(path) & (path_table_size - 1)];
+  while (it != NULL && strcmp(it->path, path) != 0)
+    it = it->path_next;
+  return it;
+}
+
+void path_table_remove(struct wnode *n) {
+  struct wnode **link = &path_table[str_hash(n->path) & (path_table_size - 1)];
+  while (*link != n)
+    link = &(*link)->path_next;
+  *link = n->path_next;
+  path_table_used--;
+}
+
+struct wnode *fh_table_find(const unsigned char *fh, unsigned int len) {
+  if (fh_table_size == 0)
+    return NULL;
+  unsigned long h = bytes_hash(fh, len);
+  struct wnode *it = fh_table[h & (fh_table_size - 1)];
+  while (it != NULL && (it->fh_hash != h || it->fh_len != len ||
+                        memcmp(it->fh, fh, len) != 0))
+    it = it->fh_next;
+  return it;
+}
+
+void mark_dirty(struct wnode *n) {
+  if (n == NULL || n->dirty_idx >= 0)
+    return;
+  if (dirty_count == dirty_cap) {
+    dirty_cap = dirty_cap ? dirty_cap * 2 : 64;
+    dirty = realloc(dirty, dirty_cap * sizeof(struct wnode *));
+    if (dirty == NULL)
+      error();
+  }
+  n->dirty_idx = dirty_count;
+  dirty[dirty_count++] = n;
+}
+
+void watch_fail(struct wnode *n) {
+  fprintf(stderr, "myDU: cannot watch %s: %s\n", n->path, strerror(errno));
+  error();
+}
 
-  int pipefd[2];
-  if (pipe(pipefd) == -1)
+// Watch the directory open as fd.
+void watch_attach(struct wnode *n, int fd) {
+  if (watch_mode == WATCH_INOTIFY) {
+    char proc[32];
+    sprintf(proc, "/proc/self/fd/%d", fd);
+    n->wd = inotify_add_watch(watch_fd, proc,
+                              IN_CREATE | IN_DELETE | IN_MODIFY |
+                                  IN_CLOSE_WRITE | IN_ATTRIB | IN_MOVED_FROM |
+                                  IN_MOVED_TO | IN_ONLYDIR);
+    if (n->wd < 0)
+      watch_fail(n);
+    if ((unsigned long)n->wd >= wd_table_size) {
+      unsigned long new_size = wd_table_size ? wd_table_size : 1024;
+      while (new_size <= (unsigned long)n->wd)
+        new_size *= 2;
+      wd_table = realloc(wd_table, new_size * sizeof(struct wnode *));
+      if (wd_table == NULL)
+        error();
+      memset(wd_table + wd_table_size, 0,
+             (new_size - wd_table_size) * sizeof(struct wnode *));
+      wd_table_size = new_size;
+    }
+    wd_table[n->wd] = n;
+  } else if (watch_mode == WATCH_FANOTIFY) {
+    struct {
+      struct file_handle fh;
+      unsigned char bytes[MAX_HANDLE_SZ];
+    } h;
+    int mount_id;
+    h.fh.handle_bytes = MAX_HANDLE_SZ;
+    if (name_to_handle_at(fd, "", &h.fh, &mount_id, AT_EMPTY_PATH) < 0)
+      watch_fail(n);
+    // Events carry the same struct file_handle layout minus handle_bytes.
+    n->fh_len = sizeof(int) + h.fh.handle_bytes;
+    n->fh = malloc(n->fh_len);
+    if (n->fh == NULL)
+      error();
+    memcpy(n->fh, &h.fh.handle_type, n->fh_len);
+    n->fh_hash = bytes_hash(n->fh, n->fh_len);
+    if (fh_table_size == 0) {
+      fh_table_size = 1 << 16;
+      fh_table = xcalloc(fh_table_size, sizeof(struct wnode *));
+    }
+    unsigned long b = n->fh_hash & (fh_table_size - 1);
+    n->fh_next = fh_table[b];
+    fh_table[b] = n;
+  }
+}
+
+void watch_detach(struct wnode *n) {
+  if (n->wd >= 0) {
+    inotify_rm_watch(watch_fd, n->wd);
+    wd_table[n->wd] = NULL;
+  }
+  if (n->fh != NULL) {
+    struct wnode **link = &fh_table[n->fh_hash & (fh_table_size - 1)];
+    while (*link != n)
+      link = &(*link)->fh_next;
+    *link = n->fh_next;
+    free(n->fh);
+  }
+}
+
+char *join_path(const char *dir, const char *name) {
+  unsigned long dlen = strlen(dir), nlen = strlen(name);
+  char *p = malloc(dlen + nlen + 2);
+  if (p == NULL)
     error();
-  int dircount = 0;
+  memcpy(p, dir, dlen);
+  p[dlen] = '/';
+  memcpy(p + dlen + 1, name, nlen + 1);
+  return p;
+}
+
+unsigned long watch_build(char *path, struct wnode *parent, int fd);
+
+#define WATCH_DIR_FLAGS (O_RDONLY | O_DIRECTORY | O_CLOEXEC)
+#define WATCH_FD_BUDGET 256
 
-  struct stat filest;
-  stat(basedir, &filest);
-  dir_size += filest.st_size;
+// Open n's directory: by its path, or through its parent's once too long.
+int watch_open(struct wnode *n) {
+  int fd = open(n->path, WATCH_DIR_FLAGS);
+  if (fd >= 0 || errno != ENAMETOOLONG || n->parent == NULL)
+    return fd;
+  int pfd = watch_open(n->parent);
+  if (pfd < 0)
+    return -1;
+  fd = openat(pfd, n->path + strlen(n->parent->path) + 1,
+              WATCH_DIR_FLAGS | O_NOFOLLOW);
+  close(pfd);
+  return fd;
+}
+
+unsigned long watch_depth = 0; // Levels of the build holding an fd
+
+void watch_free(struct wnode *n) {
+  struct wnode *c = n->child;
+  while (c != NULL) {
+    struct wnode *next = c->sibling;
+    watch_free(c);
+    c = next;
+  }
+  watch_detach(n);
+  path_table_remove(n);
+  if (n->dirty_idx >= 0)
+    dirty[n->dirty_idx] = NULL;
+  free(n->path);
+  free(n);
+}
+
+/*
+ * Re-read the direct entries of n, open as fd (closed here, -1 if it could
+ * not be opened), and return its new own size. Child directories that are
+ * new get built, ones that disappeared are returned through *gone_total;
+ * new ones are added to *added_total.
+ */
+unsigned long watch_read_dir(struct wnode *n, int fd,
+                             unsigned long *added_total,
+                             unsigned long *gone_total) {
+  struct stat dirst;
+  DIR *d;
+  if (fd < 0 || fstat(fd, &dirst) < 0 || (d = fdopendir(fd)) == NULL) {
+    if (fd >= 0)
+      close(fd);
+    return n->own_size; // Vanishing; the parent's rescan drops it
+  }
+  unsigned long own = dirst.st_size;
 
-  while ((md_iter = readdir(maindir)) != NULL) {
-    char fpath[5000];
-    strcpy(fpath, argv[1]);
-    strcat(fpath, "/");
-    strcat(fpath, md_iter->d_name);
+  for (struct wnode *c = n->child; c != NULL; c = c->sibling)
+    c->seen = 0;
 
-    if (strcmp(md_iter->d_name, ".") == 0 || strcmp(md_iter->d_name, "..") == 0)
+  // New subdirectories are built once the listing is done.
+  char **fresh = NULL;
+  unsigned long nfresh = 0, fresh_cap = 0;
+  struct dirent *ent;
+  while ((ent = readdir(d)) != NULL) {
+    if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
       continue;
-    if (md_iter->d_type == DT_DIR) {
-      dircount++;
-
-      pid_t pid = fork();
-      char *argv2[3];
-      if (!pid) {
-        char *argv2[3];
-        argv2[0] = argv[0];
-        argv2[1] = fpath;
-        argv2[2] = NULL;
-
-        close(1);
-        dup(pipefd[1]);
-
-        directory_main(argv2[1], 1);
-        exit(0);
+    unsigned char type = ent->d_type;
+    struct stat st;
+    int have_st = 0;
+    if (type == DT_UNKNOWN) {
+      if (fstatat(fd, ent->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+        continue;
+      type = IFTODT(st.st_mode);
+      have_st = 1;
+    }
+    if (type == DT_DIR) {
+      char *fpath = join_path(n->path, ent->d_name);
+      struct wnode *c = path_table_find(fpath);
+      free(fpath);
+      if (c != NULL && c->parent == n) {
+        c->seen = 1;
+        continue;
       }
-
-      close(0);
-      dup(pipefd[0]);
-
-    } else if (md_iter->d_type == DT_REG) {
-      struct stat filest;
-      stat(fpath, &filest);
-      dir_size += filest.st_size;
-    } else if (md_iter->d_type == DT_LNK) {
-      char sym_path[10000];
-      strcat(sym_path, basedir);
-      strcat(sym_path, "/");
-
-      char buf[10000];
-      for (int i = 0; i < 10000; i++) {
-        buf[i] = '\0';
+      if (nfresh == fresh_cap) {
+        fresh_cap = fresh_cap ? fresh_cap * 2 : 16;
+        if ((fresh = realloc(fresh, fresh_cap * sizeof(char *))) == NULL)
+          error();
       }
-      if (readlink(fpath, buf, 10000) == 10000)
+      if ((fresh[nfresh++] = strdup(ent->d_name)) == NULL)
         error();
-      strcat(sym_path, buf);
+    } else if (type == DT_REG) {
+      if (have_st || fstatat(fd, ent->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0)
+        own += st.st_size;
+    } else if (type == DT_LNK) {
+      // Follow like a scan does, but never exit the daemon on a dangling
+      // target.
+      own += symlink_size(fd, ent->d_name);
+    }
+  }
 
-      dir_size += symlink_main(sym_path);
+  // Past the fd budget this level gives up its fd while a subdirectory is
+  // built, and reopens it for the next one.
+  int kept = watch_depth < WATCH_FD_BUDGET;
+  watch_depth += kept;
+  for (unsigned long i = 0; i < nfresh; i++) {
+    if (fd < 0)
+      fd = watch_open(n);
+    int cfd = fd < 0 ? -1 : openat(fd, fresh[i], WATCH_DIR_FLAGS | O_NOFOLLOW);
+    if (!kept && fd >= 0) {
+      if (d != NULL)
+        closedir(d);
+      else
+        close(fd);
+      d = NULL;
+      fd = -1;
     }
+    if (cfd >= 0)
+      *added_total += watch_build(join_path(n->path, fresh[i]), n, cfd);
+    free(fresh[i]);
   }
+  free(fresh);
+  watch_depth -= kept;
+  if (d != NULL)
+    closedir(d);
+  else if (fd >= 0)
+    close(fd);
 
-  long unsigned rec_dir_size = 0;
-  while (dircount--) {
-    read(0, &rec_dir_size, sizeof(rec_dir_size));
-    dir_size += rec_dir_size;
+  struct wnode **link = &n->child;
+  while (*link != NULL) {
+    struct wnode *c = *link;
+    if (c->seen) {
+      link = &c->sibling;
+      continue;
+    }
+    *link = c->sibling;
+    *gone_total += c->total;
+    watch_free(c);
   }
-  printf("%lu\n", dir_size);
+  return own;
+}
+
+// Build the node for path, open as fd, and everything below it.
+unsigned long watch_build(char *path, struct wnode *parent, int fd) {
+  struct wnode *n = xcalloc(1, sizeof(struct wnode));
+  n->path = path;
+  n->parent = parent;
+  n->wd = -1;
+  n->seen = 1;
+  n->dirty_idx = -1;
+  if (parent != NULL) {
+    n->sibling = parent->child;
+    parent->child = n;
+  }
+  path_table_insert(n);
+  // Watch before reading so nothing created in between is missed.
+  watch_attach(n, fd);
+
+  unsigned long added = 0, gone = 0;
+  n->own_size = watch_read_dir(n, fd, &added, &gone);
+  n->total = n->own_size + added;
+  return n->total;
+}
+
+void watch_rescan(struct wnode *n) {
+  unsigned long added = 0, gone = 0;
+  unsigned long old_own = n->own_size;
+  n->own_size = watch_read_dir(n, watch_open(n), &added, &gone);
+  // Unsigned wrap-around makes this a signed delta.
+  unsigned long delta = n->own_size - old_own + added - gone;
+  if (delta == 0)
+    return;
+  for (struct wnode *it = n; it != NULL; it = it->parent)
+    it->total += delta;
+}
+
+void watch_mark_all(struct wnode *n) {
+  mark_dirty(n);
+  for (struct wnode *c = n->child; c != NULL; c = c->sibling)
+    watch_mark_all(c);
+}
+
+void watch_drain_fanotify(struct wnode *root) {
+  char buf[8192] __attribute__((aligned(8)));
+  ssize_t len;
+  while ((len = read(watch_fd, buf, sizeof(buf))) > 0) {
+    struct fanotify_event_metadata *ev = (void *)buf;
+    for (; FAN_EVENT_OK(ev, len); ev = FAN_EVENT_NEXT(ev, len)) {
+      if (ev->mask & FAN_Q_OVERFLOW) {
+        watch_mark_all(root);
+        continue;
+      }
+      struct fanotify_event_info_fid *fid = (void *)(ev + 1);
+      if ((char *)fid >= (char *)ev + ev->event_len ||
+          fid->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID_NAME)
+        continue;
+      struct file_handle *fh = (struct file_handle *)fid->handle;
+      mark_dirty(fh_table_find((unsigned char *)&fh->handle_type,
+                               sizeof(int) + fh->handle_bytes));
+    }
+  }
+}
+
+void watch_drain_inotify(struct wnode *root) {
+  char buf[8192] __attribute__((aligned(8)));
+  ssize_t len;
+  while ((len = read(watch_fd, buf, sizeof(buf))) > 0) {
+    for (char *p = buf; p < buf + len;) {
+      struct inotify_event *ev = (void *)p;
+      p += sizeof(struct inotify_event) + ev->len;
+      if (ev->mask & IN_Q_OVERFLOW)
+        watch_mark_all(root);
+      else if (ev->wd >= 0 && (unsigned long)ev->wd < wd_table_size &&
+               !(ev->mask & IN_IGNORED))
+        mark_dirty(wd_table[ev->wd]);
+    }
+  }
+}
+
+void watch_init(char *basedir) {
+  watch_fd = fanotify_init(FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME |
+                               FAN_NONBLOCK | FAN_CLOEXEC,
+                           O_RDONLY | O_LARGEFILE);
+  if (watch_fd >= 0 &&
+      fanotify_mark(watch_fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM,
+                    FAN_CREATE | FAN_DELETE | FAN_MOVED_FROM | FAN_MOVED_TO |
+                        FAN_MODIFY | FAN_CLOSE_WRITE | FAN_ATTRIB | FAN_ONDIR,
+                    AT_FDCWD, basedir) == 0) {
+    watch_mode = WATCH_FANOTIFY;
+    return;
+  }
+  if (watch_fd >= 0)
+    close(watch_fd);
+  watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (watch_fd < 0)
+    error();
+  watch_mode = WATCH_INOTIFY;
+}
+
+/*
+ * One request per connection: the client writes a path (absolute as given on
+ * the command line, or relative to the watched root; empty for the root),
+ * ends it with a newline or by shutting down its side, and reads back
+ * "<bytes>\n", or "Unable to execute\n" if it is not a watched directory.
+ * Connections are non-blocking and polled with the watch fd, so a slow
+ * client never holds up event handling; one that has not finished its
+ * request within WATCH_CONN_SECS is dropped.
+ */
+#define WATCH_CONNS 16
+#define WATCH_CONN_SECS 1.0
+
+struct wconn {
+  int fd; // -1 when the slot is free
+  unsigned long len;
+  double deadline;
+  char req[4096];
+};
+
+struct wconn wconns[WATCH_CONNS];
+
+void watch_answer(struct wconn *c, struct wnode *root) {
+  char *req = c->req;
+  unsigned long len = c->len;
+  req[len] = '\0';
+  char *nl = strchr(req, '\n');
+  if (nl != NULL)
+    len = nl - req;
+  req[len] = '\0';
+  while (len > 0 && req[len - 1] == '/')
+    req[--len] = '\0';
+
+  struct wnode *n = len == 0 ? root : path_table_find(req);
+  if (n == NULL) {
+    char *full = join_path(root->path, req);
+    n = path_table_find(full);
+    free(full);
+  }
+  char reply[32];
+  int rlen = n != NULL ? sprintf(reply, "%lu\n", n->total)
+                       : sprintf(reply, "Unable to execute\n");
+  // A fresh socket's buffer always takes the reply; a gone client is ignored.
+  send(c->fd, reply, rlen, MSG_NOSIGNAL | MSG_DONTWAIT);
+  close(c->fd);
+  c->fd = -1;
+}
+
+// Read what conn has; answer once the request is complete.
+void watch_serve(struct wconn *c, struct wnode *root) {
+  ssize_t n = read(c->fd, c->req + c->len, sizeof(c->req) - 1 - c->len);
+  if (n < 0 && (errno == EAGAIN || errno == EINTR))
+    return;
+  if (n > 0) {
+    c->len += n;
+    if (memchr(c->req, '\n', c->len) == NULL &&
+        c->len < sizeof(c->req) - 1)
+      return;
+  }
+  watch_answer(c, root);
+}
+
+void watch_main(char *basedir, char *sock_path) {
+  unsigned long blen = strlen(basedir);
+  while (blen > 1 && basedir[blen - 1] == '/')
+    basedir[--blen] = '\0';
+
+  int lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (lfd < 0 || strlen(sock_path) >= sizeof(addr.sun_path))
+    error();
+  strcpy(addr.sun_path, sock_path);
+  // Only a stale socket of our own is replaced: one nothing answers on.
+  struct stat st;
+  if (lstat(sock_path, &st) == 0) {
+    int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (!S_ISSOCK(st.st_mode) || st.st_uid != getuid() || probe < 0 ||
+        connect(probe, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+      error();
+    close(probe);
+    unlink(sock_path);
+  }
+  // Only our user may connect.
+  mode_t mask = umask(0077);
+  int bound = bind(lfd, (struct sockaddr *)&addr, sizeof(addr));
+  umask(mask);
+  if (bound < 0 || listen(lfd, 64) < 0)
+    error();
+
+  watch_init(basedir);
+  char *root_path = malloc(blen + 1);
+  if (root_path == NULL)
+    error();
+  strcpy(root_path, basedir);
+  int root_fd = open(root_path, WATCH_DIR_FLAGS);
+  if (root_fd < 0)
+    error();
+  watch_build(root_path, NULL, root_fd);
+  struct wnode *root = path_table_find(root_path);
+  printf("%lu\n", root->total);
+  fflush(stdout);
+
+  for (int i = 0; i < WATCH_CONNS; i++)
+    wconns[i].fd = -1;
+  struct pollfd fds[2 + WATCH_CONNS];
+  int polled[WATCH_CONNS]; // wconns index of fds[2 + i]
+  fds[0].fd = watch_fd;
+  fds[0].events = POLLIN;
+  fds[1].fd = lfd;
+  while (1) {
+    // Drop stalled clients, and stop accepting while every slot is taken.
+    double now = stats_now();
+    double next = -1;
+    int nfds = 2;
+    for (int i = 0; i < WATCH_CONNS; i++) {
+      struct wconn *c = &wconns[i];
+      if (c->fd >= 0 && c->deadline <= now) {
+        close(c->fd);
+        c->fd = -1;
+      }
+      if (c->fd < 0)
+        continue;
+      if (next < 0 || c->deadline < next)
+        next = c->deadline;
+      polled[nfds - 2] = i;
+      fds[nfds].fd = c->fd;
+      fds[nfds++].events = POLLIN;
+    }
+    fds[1].events = nfds - 2 < WATCH_CONNS ? POLLIN : 0;
+    int timeout = next < 0 ? -1 : (int)((next - now) * 1000) + 1;
+    if (poll(fds, nfds, timeout) < 0) {
+      if (errno == EINTR)
+        continue;
+      error();
+    }
+    if (fds[0].revents & POLLIN) {
+      if (watch_mode == WATCH_FANOTIFY)
+        watch_drain_fanotify(root);
+      else
+        watch_drain_inotify(root);
+      // A rescan may free dirty descendants; watch_free clears their slots.
+      for (unsigned long i = 0; i < dirty_count; i++) {
+        struct wnode *n = dirty[i];
+        if (n == NULL)
+          continue;
+        n->dirty_idx = -1;
+        dirty[i] = NULL;
+        watch_rescan(n);
+      }
+      dirty_count = 0;
+    }
+    for (int i = 2; i < nfds; i++) {
+      if (fds[i].revents != 0)
+        watch_serve(&wconns[polled[i - 2]], root);
+    }
+    if (fds[1].revents & POLLIN) {
+      int conn = accept4(lfd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+      for (int i = 0; conn >= 0 && i < WATCH_CONNS; i++) {
+        if (wconns[i].fd < 0) {
+          wconns[i].fd = conn;
+          wconns[i].len = 0;
+          wconns[i].deadline = stats_now() + WATCH_CONN_SECS;
+          break;
+        }
+      }
+    }
+  }
+}
+
+void watch_query(char *sock_path, char *path) {
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (fd < 0 || strlen(sock_path) >= sizeof(addr.sun_path))
+    error();
+  strcpy(addr.sun_path, sock_path);
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    error();
+  write(fd, path, strlen(path));
+  shutdown(fd, SHUT_WR);
+  char reply[64];
+  ssize_t len = read(fd, reply, sizeof(reply));
+  if (len <= 0)
+    error();
+  fwrite(reply, 1, len, stdout);
   exit(0);
 }
+
+/*
+ * myDU: print the total apparent size of a directory tree.
+ *
+ *   gcc -O2 -o myDU myDU.c mydu.c -lpthread
+ */
+int main(int argc, char *argv[]) {
+  // Usage: myDU [--cache FILE] [--exclude PATTERN]... [--inode-order]
+  //             [--keep-going] [--metrics LIST] [--progress SECS]
+  //             [--snapshot FILE] [--stats] [--stream FORMAT] [--threads N]
+  //             [--top N] [-x] DIR
+  //        myDU --estimate SECONDS|--estimate-entries N [--exclude PATTERN]...
+  //             [-x] DIR
+  //        myDU --diff OLD NEW [--top N]
+  //        myDU --watch DIR [--socket SOCK]
+  //        myDU --query SOCK [PATH]
+  struct mydu_opts opts;
+  mydu_opts_init(&opts);
+  char *basedir = NULL;
+  char *sock_path = "myDU.sock";
+  char *query_sock = NULL;
+  char *snap_path = NULL;
+  char *diff_old = NULL;
+  int watch = 0;
+  double est_seconds = 0;
+  unsigned long est_entries = 0;
+  int metrics[4] = {METRIC_SIZE};
+  int nmetrics = 1;
+  const char **exclude = calloc(argc, sizeof(char *));
+  int nexclude = 0;
+  if (exclude == NULL)
+    error();
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc)
+      opts.cache_path = argv[++i];
+    else if (strcmp(argv[i], "--exclude") == 0 && i + 1 < argc)
+      exclude[nexclude++] = argv[++i];
+    else if (strcmp(argv[i], "-x") == 0)
+      opts.one_filesystem = 1;
+    else if (strcmp(argv[i], "--metrics") == 0 && i + 1 < argc)
+      nmetrics = parse_metrics(argv[++i], metrics);
+    else if (strcmp(argv[i], "--keep-going") == 0)
+      opts.keep_going = 1;
+    else if (strcmp(argv[i], "--stream") == 0 && i + 1 < argc)
+      stream_format = strcmp(argv[++i], "ndjson") == 0   ? STREAM_NDJSON
+                      : strcmp(argv[i], "binary") == 0 ? STREAM_BINARY
+                                                       : -1;
+    else if (strcmp(argv[i], "--progress") == 0 && i + 1 < argc)
+      progress_secs = atof(argv[++i]);
+    else if (strcmp(argv[i], "--stats") == 0)
+      want_stats = 1;
+    else if (strcmp(argv[i], "--snapshot") == 0 && i + 1 < argc)
+      snap_path = argv[++i];
+    else if (strcmp(argv[i], "--diff") == 0 && i + 2 < argc)
+      diff_old = argv[++i];
+    else if (strcmp(argv[i], "--estimate") == 0 && i + 1 < argc)
+      est_seconds = atof(argv[++i]);
+    else if (strcmp(argv[i], "--estimate-entries") == 0 && i + 1 < argc)
+      est_entries = strtoul(argv[++i], NULL, 10);
+    else if (strcmp(argv[i], "--inode-order") == 0)
+      opts.inode_order = 1;
+    else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+      opts.threads = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--top") == 0 && i + 1 < argc)
+      top_n = strtoul(argv[++i], NULL, 10);
+    else if (strcmp(argv[i], "--watch") == 0)
+      watch = 1;
+    else if (strcmp(argv[i], "--socket") == 0 && i + 1 < argc)
+      sock_path = argv[++i];
+    else if (strcmp(argv[i], "--query") == 0 && i + 1 < argc)
+      query_sock = argv[++i];
+    else if (basedir == NULL)
+      basedir = argv[i];
+    else
+      error();
+  }
+  if (query_sock != NULL)
+    watch_query(query_sock, basedir != NULL ? basedir : "");
+  if (basedir == NULL)
+    error();
+  if (diff_old != NULL) {
+    if (top_n == 0)
+      top_n = 10;
+    snap_diff(diff_old, basedir);
+  }
+  if (watch)
+    watch_main(basedir, sock_path);
+  if (nexclude > 0)
+    opts.exclude = exclude;
+  if (est_seconds > 0 || est_entries > 0) {
+    // Estimate first, then its 95% interval and how it was obtained.
+    struct mydu_estimate est;
+    if (mydu_estimate(basedir, &opts, est_seconds, est_entries, &est) < 0)
+      error();
+    printf("%.0f\t+-%.0f\t(%s%lu strata, %lu probes, %lu entries)\n",
+           est.size, est.size_ci, est.exact ? "exact, " : "", est.strata,
+           est.probes, est.entries);
+    exit(0);
+  }
+  if (top_n > 0) {
+    top_dirs = top_alloc(top_n);
+    top_files = top_alloc(top_n);
+  }
+  // Reports would land in the middle of the stream.
+  if (stream_format < 0 ||
+      (stream_format != STREAM_NONE && (top_n > 0 || want_ext)))
+    error();
+  if (snap_path != NULL)
+    snap_open(snap_path, basedir);
+  if (top_n > 0 || stream_format != STREAM_NONE || opts.keep_going ||
+      snap_path != NULL)
+    opts.on_dir = scan_on_dir;
+  if (top_n > 0 || want_ext)
+    opts.on_file = scan_on_file;
+  if (stream_format == STREAM_BINARY)
+    stream_put("MDUSTRM1", 8);
+
+  struct mydu_usage usage;
+  stats_begin(&opts);
+  if (mydu_scan_usage(basedir, &opts, &usage) < 0)
+    error();
+  stats_end();
+  if (snap_path != NULL)
+    snap_close();
+  if (stream_format != STREAM_NONE) {
+    // The root's record already carries the totals.
+    stream_flush();
+    exit(root_flags & MYDU_INCOMPLETE ? 1 : 0);
+  }
+  unsigned long values[4] = {usage.size, usage.alloc, usage.files,
+                             usage.dirs};
+  for (int i = 0; i < nmetrics; i++)
+    printf(i + 1 < nmetrics ? "%lu\t" : "%lu\n", values[metrics[i]]);
+  if (want_ext)
+    ext_report();
+  if (top_n > 0) {
+    top_report(top_dirs, "", "/");
+    top_report(top_files, "", "");
+  }
+  exit(root_flags & MYDU_INCOMPLETE ? 1 : 0);
+}
@@ -0,0 +1,1951 @@
+/*
+ * libmydu: directory size traversal shared by myDU and embedding agents.
+ * See mydu.h for the interface.
+ */
+#define _GNU_SOURCE
+#include "mydu.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Persistent size cache. Maps a directory's (dev, ino) to the (mtime, ctime)
+ * it had when last scanned and its own usage: the directory inode plus the
+ * regular files directly inside it. An unchanged directory contributes that
+ * figure without stat-ing its files; subdirectories and symlinks are still
+ * visited, since a change deep in the tree does not touch an ancestor's mtime.
+ * Files grown in place do not touch their directory either, so cached sizes
+ * are as fresh as the directory listings they were computed from.
+ *
+ * The file is mapped MAP_SHARED, so concurrent scans (threads or processes)
+ * read and fill one table; slots are claimed with CAS and read with a
+ * generation check.
+ */
+#define CACHE_MAGIC 0x324341434b55444dUL // "MDUKCAC2"
+#define CACHE_SLOTS_DEFAULT (1UL << 16)
+
+// The low two bits of a slot's state are its kind; the rest count the
+// rewrites of the slot, so readers can tell a copy raced with one.
+#define SLOT_EMPTY 0
+#define SLOT_BUSY 1
+#define SLOT_READY 2
+#define SLOT_KIND(state) ((state) & 3)
+#define SLOT_GEN(state) ((state) & ~3UL)
+
+struct cache_key {
+  unsigned long dev;
+  unsigned long ino;
+  unsigned long mtime_sec;
+  unsigned long mtime_nsec;
+  unsigned long ctime_sec;
+  unsigned long ctime_nsec;
+};
+
+struct cache_slot {
+  unsigned long state;
+  struct cache_key key;
+  struct mydu_usage own;
+};
+
+struct cache_header {
+  unsigned long magic;
+  unsigned long nslots; // Always a power of two
+  unsigned long used;
+  unsigned long pad[5];
+};
+
+static unsigned long cache_hash(unsigned long dev, unsigned long ino) {
+  unsigned long h = ino * 0x9e3779b97f4a7c15UL ^ dev * 0xc2b2ae3d27d4eb4fUL;
+  return h ^ (h >> 29);
+}
+
+static void cache_key_of(struct stat *st, struct cache_key *key) {
+  key->dev = st->st_dev;
+  key->ino = st->st_ino;
+  key->mtime_sec = st->st_mtim.tv_sec;
+  key->mtime_nsec = st->st_mtim.tv_nsec;
+  key->ctime_sec = st->st_ctim.tv_sec;
+  key->ctime_nsec = st->st_ctim.tv_nsec;
+}
+
+static off_t cache_len(unsigned long nslots) {
+  return sizeof(struct cache_header) + nslots * sizeof(struct cache_slot);
+}
+
+static struct cache_header *cache_map(int fd, unsigned long nslots,
+                                      int resize) {
+  off_t len = cache_len(nslots);
+  if (resize && ftruncate(fd, len) < 0)
+    return NULL;
+  void *mem = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (mem == MAP_FAILED)
+    return NULL;
+  return mem;
+}
+
+static void cache_unmap(struct cache_header *hdr) {
+  munmap(hdr, cache_len(hdr->nslots));
+}
+
+static void cache_put(struct cache_header *hdr, struct cache_key *key,
+                      struct mydu_usage *own);
+
+// Grow before the scan starts once the table is 3/4 full, so lookups stay
+// short and inserts during the scan rarely fail.
+static int cache_full(struct cache_header *hdr) {
+  return hdr->used * 4 >= hdr->nslots * 3;
+}
+
+// Under LOCK_EX: create, validate or grow the table in place.
+static int cache_prepare(int fd) {
+  struct stat cst;
+  struct cache_header *hdr;
+  if (fstat(fd, &cst) < 0)
+    return -1;
+  if (cst.st_size < (off_t)sizeof(struct cache_header)) {
+    if ((hdr = cache_map(fd, CACHE_SLOTS_DEFAULT, 1)) == NULL)
+      return -1;
+    hdr->magic = CACHE_MAGIC;
+    hdr->nslots = CACHE_SLOTS_DEFAULT;
+    hdr->used = 0;
+    cache_unmap(hdr);
+    return 0;
+  }
+  struct cache_header probe;
+  if (pread(fd, &probe, sizeof(probe), 0) != sizeof(probe) ||
+      probe.magic != CACHE_MAGIC || probe.nslots == 0 ||
+      (probe.nslots & (probe.nslots - 1)) != 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  // A file cut short is extended with empty slots.
+  if (!cache_full(&probe))
+    return cst.st_size < cache_len(probe.nslots)
+               ? ftruncate(fd, cache_len(probe.nslots))
+               : 0;
+
+  unsigned long old_nslots = probe.nslots;
+  unsigned long len = old_nslots * sizeof(struct cache_slot);
+  struct cache_slot *old = malloc(len);
+  if (old == NULL)
+    return -1;
+  if (pread(fd, old, len, sizeof(probe)) != (ssize_t)len ||
+      (hdr = cache_map(fd, old_nslots * 2, 1)) == NULL) {
+    free(old);
+    return -1;
+  }
+  memset((void *)(hdr + 1), 0, 2 * len);
+  hdr->nslots = old_nslots * 2;
+  hdr->used = 0;
+  for (unsigned long i = 0; i < old_nslots; i++) {
+    if (SLOT_KIND(old[i].state) == SLOT_READY)
+      cache_put(hdr, &old[i].key, &old[i].own);
+  }
+  free(old);
+  cache_unmap(hdr);
+  return 0;
+}
+
+/*
+ * Every process keeps LOCK_SH on the file for as long as it has it mapped;
+ * creating or growing the table takes LOCK_EX, so a resize never truncates
+ * or clears a table another scan is using. The lock goes with *lock_fd,
+ * which the caller closes after cache_unmap().
+ */
+static struct cache_header *cache_open(const char *path, int *lock_fd) {
+  int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd < 0)
+    return NULL;
+  errno = EBUSY; // Kept if other processes keep resizing under us
+  for (int tries = 0; tries < 4; tries++) {
+    struct cache_header probe;
+    struct stat cst;
+    if (flock(fd, LOCK_SH) < 0 || fstat(fd, &cst) < 0)
+      break;
+    if (pread(fd, &probe, sizeof(probe), 0) == sizeof(probe) &&
+        probe.magic == CACHE_MAGIC && probe.nslots != 0 &&
+        (probe.nslots & (probe.nslots - 1)) == 0 && !cache_full(&probe) &&
+        cst.st_size >= cache_len(probe.nslots)) {
+      struct cache_header *hdr = cache_map(fd, probe.nslots, 0);
+      if (hdr == NULL)
+        break;
+      *lock_fd = fd;
+      return hdr;
+    }
+    // Converting the lock may let another process resize first; the
+    // header is read again under LOCK_SH on the next round either way.
+    if (flock(fd, LOCK_EX) < 0 || cache_prepare(fd) < 0)
+      break;
+  }
+  int saved = errno;
+  close(fd);
+  errno = saved;
+  return NULL;
+}
+
+static int cache_get(struct cache_header *hdr, struct cache_key *key,
+                     struct mydu_usage *own) {
+  if (hdr == NULL)
+    return 0;
+  struct cache_slot *slots = (struct cache_slot *)(hdr + 1);
+  unsigned long mask = hdr->nslots - 1;
+  unsigned long i = cache_hash(key->dev, key->ino) & mask;
+  for (unsigned long probes = 0; probes <= mask; probes++, i = (i + 1) & mask) {
+    struct cache_slot *slot = &slots[i];
+    unsigned long state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+    if (state == SLOT_EMPTY)
+      return 0;
+    if (SLOT_KIND(state) != SLOT_READY || slot->key.dev != key->dev ||
+        slot->key.ino != key->ino)
+      continue;
+    // A writer may have claimed the slot while it was being copied; the
+    // generation in state changes with every rewrite, so a copy taken
+    // under an unchanged state is whole. Anything else is a miss.
+    struct cache_key seen = slot->key;
+    struct mydu_usage usage = slot->own;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&slot->state, __ATOMIC_RELAXED) != state ||
+        memcmp(&seen, key, sizeof(*key)) != 0)
+      return 0;
+    *own = usage;
+    return 1;
+  }
+  return 0;
+}
+
+static void cache_put(struct cache_header *hdr, struct cache_key *key,
+                      struct mydu_usage *own) {
+  if (hdr == NULL)
+    return;
+  struct cache_slot *slots = (struct cache_slot *)(hdr + 1);
+  unsigned long mask = hdr->nslots - 1;
+  unsigned long i = cache_hash(key->dev, key->ino) & mask;
+  for (unsigned long probes = 0; probes <= mask; probes++, i = (i + 1) & mask) {
+    struct cache_slot *slot = &slots[i];
+    unsigned long state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+    if (state == SLOT_EMPTY) {
+      // Stop filling at 7/8 so probe chains stay bounded until the next
+      // run grows the file.
+      if (hdr->used * 8 >= hdr->nslots * 7)
+        return;
+      if (!__atomic_compare_exchange_n(&slot->state, &state,
+                                       SLOT_GEN(state) | SLOT_BUSY, 0,
+                                       __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        continue;
+      __atomic_add_fetch(&hdr->used, 1, __ATOMIC_RELAXED);
+    } else if (SLOT_KIND(state) == SLOT_READY && slot->key.dev == key->dev &&
+               slot->key.ino == key->ino) {
+      if (!__atomic_compare_exchange_n(&slot->state, &state,
+                                       SLOT_GEN(state) | SLOT_BUSY, 0,
+                                       __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return; // Someone else is refreshing the same directory
+    } else {
+      continue;
+    }
+    slot->key = *key;
+    slot->own = *own;
+    __atomic_store_n(&slot->state, (SLOT_GEN(state) + 4) | SLOT_READY,
+                     __ATOMIC_RELEASE);
+    return;
+  }
+}
+
+
+/*
+ * Inode-ordered mode. A directory's entries are read in full
+ * into a batch and sorted by d_ino before any of them is stat-ed, so the
+ * inode table is visited in one sweep instead of in hash order; on rotational
+ * disks that turns random seeks into mostly sequential reads, as fts and ncdu
+ * do. It costs one batch per level of the current path.
+ */
+struct batch_ent {
+  unsigned long ino;
+  unsigned long name_off;
+  unsigned char type;
+};
+
+struct dir_batch {
+  struct batch_ent *ents;
+  unsigned long n;
+  unsigned long cap;
+  unsigned long next;
+  char *names;
+  unsigned long names_len;
+  unsigned long names_cap;
+};
+
+static int batch_ent_cmp(const void *a, const void *b) {
+  unsigned long x = ((struct batch_ent *)a)->ino;
+  unsigned long y = ((struct batch_ent *)b)->ino;
+  return x < y ? -1 : x > y ? 1 : 0;
+}
+
+static int is_dot(char *name) {
+  return name[0] == '.' &&
+         (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'));
+}
+
+static void batch_free(struct dir_batch *b);
+
+// Read the rest of dir into a batch sorted by inode; NULL if out of memory.
+static struct dir_batch *batch_fill(DIR *dir) {
+  struct dir_batch *b = calloc(1, sizeof(struct dir_batch));
+  if (b == NULL)
+    return NULL;
+  struct dirent *md_iter;
+  while ((md_iter = readdir(dir)) != NULL) {
+    if (is_dot(md_iter->d_name))
+      continue;
+    unsigned long nlen = strlen(md_iter->d_name) + 1;
+    if (b->n == b->cap) {
+      b->cap = b->cap ? b->cap * 2 : 64;
+      void *ents = realloc(b->ents, b->cap * sizeof(struct batch_ent));
+      if (ents == NULL)
+        goto fail;
+      b->ents = ents;
+    }
+    if (b->names_len + nlen > b->names_cap) {
+      while (b->names_len + nlen > b->names_cap)
+        b->names_cap = b->names_cap ? b->names_cap * 2 : 1024;
+      void *names = realloc(b->names, b->names_cap);
+      if (names == NULL)
+        goto fail;
+      b->names = names;
+    }
+    struct batch_ent *e = &b->ents[b->n++];
+    e->ino = md_iter->d_ino;
+    e->name_off = b->names_len;
+    e->type = md_iter->d_type;
+    memcpy(b->names + b->names_len, md_iter->d_name, nlen);
+    b->names_len += nlen;
+  }
+  if (b->n > 0)
+    qsort(b->ents, b->n, sizeof(struct batch_ent), batch_ent_cmp);
+  return b;
+
+fail:
+  batch_free(b);
+  return NULL;
+}
+
+static void batch_free(struct dir_batch *b) {
+  if (b == NULL)
+    return;
+  free(b->ents);
+  free(b->names);
+  free(b);
+}
+
+/*
+ * Exclusion patterns, compiled once per scan. Most patterns in practice are
+ * an exact name ("node_modules"), a suffix ("*.o") or a prefix ("cache*"),
+ * so those are recognised up front and matched with a length check and one
+ * memcmp; exact names are compared by hash first. Anything else falls back
+ * to fnmatch(). A pattern without '/' is matched against the entry's name,
+ * one with '/' against its full path. Matching happens before the entry is
+ * stat-ed or opened, so an excluded subtree costs nothing but its dirent.
+ */
+#define PAT_EXACT 0
+#define PAT_PREFIX 1 // "lit*"
+#define PAT_SUFFIX 2 // "*lit"
+#define PAT_GLOB 3
+#define PAT_PATH 4 // Contains '/'; fnmatch() on the full path
+
+struct pattern {
+  int kind;
+  const char *text; // The literal part, or the whole pattern
+  unsigned long len;
+  unsigned long hash; // PAT_EXACT only
+};
+
+struct exclude {
+  unsigned long n;
+  int has_path; // Some pattern needs the full path
+  struct pattern pats[];
+};
+
+static unsigned long name_hash(const char *name, unsigned long len) {
+  unsigned long h = 14695981039346656037UL;
+  for (unsigned long i = 0; i < len; i++)
+    h = (h ^ (unsigned char)name[i]) * 1099511628211UL;
+  return h;
+}
+
+// Returns NULL with errno set if out of memory; NULL and 0 if no patterns.
+static struct exclude *exclude_compile(const char *const *patterns) {
+  unsigned long n = 0;
+  while (patterns != NULL && patterns[n] != NULL)
+    n++;
+  errno = 0;
+  if (n == 0)
+    return NULL;
+  struct exclude *ex = malloc(sizeof(struct exclude) +
+                              n * sizeof(struct pattern));
+  if (ex == NULL)
+    return NULL;
+  ex->n = n;
+  ex->has_path = 0;
+  for (unsigned long i = 0; i < n; i++) {
+    const char *p = patterns[i];
+    unsigned long len = strlen(p);
+    struct pattern *pat = &ex->pats[i];
+    const char *meta = strpbrk(p, "*?[\\");
+    pat->text = p;
+    pat->len = len;
+    if (strchr(p, '/') != NULL) {
+      pat->kind = PAT_PATH;
+      ex->has_path = 1;
+    } else if (meta == NULL) {
+      pat->kind = PAT_EXACT;
+      pat->hash = name_hash(p, len);
+    } else if (meta == p + len - 1 && *meta == '*') {
+      pat->kind = PAT_PREFIX;
+      pat->len = len - 1;
+    } else if (meta == p && *p == '*' && strpbrk(p + 1, "*?[\\") == NULL) {
+      pat->kind = PAT_SUFFIX;
+      pat->text = p + 1;
+      pat->len = len - 1;
+    } else {
+      pat->kind = PAT_GLOB;
+    }
+  }
+  return ex;
+}
+
+// path may be NULL unless ex->has_path is set.
+static int exclude_match(struct exclude *ex, const char *name,
+                         const char *path) {
+  unsigned long len = strlen(name);
+  unsigned long hash = 0;
+  for (unsigned long i = 0; i < ex->n; i++) {
+    struct pattern *pat = &ex->pats[i];
+    switch (pat->kind) {
+    case PAT_EXACT:
+      if (hash == 0)
+        hash = name_hash(name, len);
+      if (pat->hash == hash && pat->len == len &&
+          memcmp(pat->text, name, len) == 0)
+        return 1;
+      break;
+    case PAT_PREFIX:
+      if (len >= pat->len && memcmp(pat->text, name, pat->len) == 0)
+        return 1;
+      break;
+    case PAT_SUFFIX:
+      if (len >= pat->len &&
+          memcmp(pat->text, name + len - pat->len, pat->len) == 0)
+        return 1;
+      break;
+    case PAT_GLOB:
+      if (fnmatch(pat->text, name, 0) == 0)
+        return 1;
+      break;
+    case PAT_PATH:
+      if (fnmatch(pat->text, path, FNM_PATHNAME) == 0)
+        return 1;
+      break;
+    }
+  }
+  return 0;
+}
+
+// Everything one stat says about an entry, counted at this name.
+static void usage_of(struct stat *st, struct mydu_usage *u) {
+  u->size = st->st_size;
+  u->alloc = (unsigned long)st->st_blocks * 512;
+  u->files = S_ISREG(st->st_mode);
+  u->dirs = S_ISDIR(st->st_mode);
+}
+
+static void usage_add(struct mydu_usage *a, const struct mydu_usage *b) {
+  a->size += b->size;
+  a->alloc += b->alloc;
+  a->files += b->files;
+  a->dirs += b->dirs;
+}
+
+static void usage_add_atomic(struct mydu_usage *a,
+                             const struct mydu_usage *b) {
+  __atomic_add_fetch(&a->size, b->size, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&a->alloc, b->alloc, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&a->files, b->files, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&a->dirs, b->dirs, __ATOMIC_RELAXED);
+}
+
+/*
+ * Iterative traversal. Each level of the explicit stack keeps only its open
+ * directory stream, the directory's identity and its running sums; entries
+ * are reached with *at() calls relative to the stream's fd, and the path is
+ * kept once, in a growable buffer, for callbacks. Only the FD_BUDGET deepest
+ * levels hold an fd: older ones are parked (closedir) and reopened through
+ * ".." of the child when the walk climbs back to them. A telldir() cookie is
+ * only good for the stream it came from, so a reopened level instead skips
+ * as many entries as it had read; a directory changed meanwhile may then
+ * have entries missed or counted twice, as with any concurrent change.
+ */
+#define FD_BUDGET 256
+
+#define FRAME_CACHED 1      // Own usage came from the cache; skip file stats
+#define FRAME_LINKED 2      // Reached through a symlink (MYDU_LINKED)
+#define FRAME_LINK_ROOT 4   // The directory a followed symlink points to
+#define FRAME_TAINTED 8     // A symlink cycle was cut somewhere below
+#define FRAME_ERROR 16      // An entry could not be read (keep_going)
+#define FRAME_INCOMPLETE 32 // FRAME_ERROR here or somewhere below
+// What a finished directory passes up to its parent.
+#define FRAME_INHERITED (FRAME_TAINTED | FRAME_INCOMPLETE)
+
+/*
+ * Symlink target memo. Many links often point at the same few directories;
+ * the first one to be followed is walked, and its subtree usage is recorded
+ * under the target's (dev, ino), so every later link to it costs the stat
+ * that identifies the target and a lookup. A subtree in which a symlink
+ * cycle was cut is not recorded, since what gets cut depends on where the
+ * walk came from. Like the size cache, the memo is skipped when a file
+ * callback has to see every file; a directory callback gets one entry for
+ * the link instead of its whole subtree.
+ */
+struct memo_slot {
+  unsigned long dev;
+  unsigned long ino; // 0 for an empty slot
+  struct mydu_usage usage;
+};
+
+struct memo {
+  pthread_mutex_t lock;
+  struct memo_slot *slots;
+  unsigned long nslots; // Power of two, or 0 before the first insert
+  unsigned long used;
+};
+
+static int memo_get(struct memo *m, struct stat *st,
+                    struct mydu_usage *usage) {
+  int found = 0;
+  pthread_mutex_lock(&m->lock);
+  if (m->nslots > 0) {
+    unsigned long mask = m->nslots - 1;
+    unsigned long i = cache_hash(st->st_dev, st->st_ino) & mask;
+    for (; m->slots[i].ino != 0; i = (i + 1) & mask) {
+      if (m->slots[i].dev == (unsigned long)st->st_dev &&
+          m->slots[i].ino == (unsigned long)st->st_ino) {
+        *usage = m->slots[i].usage;
+        found = 1;
+        break;
+      }
+    }
+  }
+  pthread_mutex_unlock(&m->lock);
+  return found;
+}
+
+static void memo_insert(struct memo_slot *slots, unsigned long nslots,
+                        struct memo_slot *item) {
+  unsigned long mask = nslots - 1;
+  unsigned long i = cache_hash(item->dev, item->ino) & mask;
+  while (slots[i].ino != 0 &&
+         (slots[i].dev != item->dev || slots[i].ino != item->ino))
+    i = (i + 1) & mask;
+  slots[i] = *item;
+}
+
+// Best effort: an entry that does not fit is simply walked again.
+static void memo_put(struct memo *m, struct cache_key *key,
+                     struct mydu_usage *usage) {
+  struct memo_slot item = {key->dev, key->ino, *usage};
+  pthread_mutex_lock(&m->lock);
+  if ((m->used + 1) * 2 > m->nslots) {
+    unsigned long nslots = m->nslots ? m->nslots * 2 : 64;
+    struct memo_slot *slots = calloc(nslots, sizeof(struct memo_slot));
+    if (slots == NULL) {
+      pthread_mutex_unlock(&m->lock);
+      return;
+    }
+    for (unsigned long i = 0; i < m->nslots; i++)
+      if (m->slots[i].ino != 0)
+        memo_insert(slots, nslots, &m->slots[i]);
+    free(m->slots);
+    m->slots = slots;
+    m->nslots = nslots;
+  }
+  memo_insert(m->slots, m->nslots, &item);
+  m->used++;
+  pthread_mutex_unlock(&m->lock);
+}
+
+/*
+ * Scheduling. With more than one thread, a walk that opens a subdirectory
+ * which looks large (it has subdirectories of its own, or its listing spans
+ * more than a block) hands it, already open, to the shared queue whenever the
+ * queue holds fewer tasks than there are workers, at any depth. Nobody waits
+ * for a handed-off subtree: its parent directory gets a join record counting
+ * outstanding contributions, and whichever thread delivers the last one
+ * completes the directory (callback, cache entry) and passes the total up
+ * to the next join, up to the root.
+ */
+struct join {
+  struct join *next; // Live joins, freed by mydu_scan after a failure
+  struct join *prev;
+  struct join *parent;   // NULL for the scan root
+  unsigned long pending; // Owner plus outstanding children
+  struct mydu_usage sub;
+  int inherited; // FRAME_INHERITED from children that completed elsewhere
+  // Set by the owner once it has read every entry.
+  struct cache_key key;
+  struct mydu_usage own;
+  struct mydu_usage base; // Everything the owner summed itself
+  unsigned long depth;
+  int flags;
+  char *path;
+};
+
+struct frame {
+  DIR *dir; // NULL while parked
+  unsigned long nread; // Entries readdir() returned, to resume after parking
+  struct dir_batch *batch; // Sorted entries in inode_order mode
+  struct join *join;       // Created once a child completes elsewhere
+  struct cache_key key;
+  struct mydu_usage own; // The directory inode and its regular files
+  struct mydu_usage sub; // Subdirectories and symlinks
+  unsigned long path_len;
+  int flags;
+};
+
+struct dir_id {
+  unsigned long dev;
+  unsigned long ino;
+};
+
+// A subtree handed to another thread, with the directories above it so
+// symlink cycles through them are still caught.
+struct task {
+  struct task *next;
+  int fd;
+  int flags;
+  struct join *parent;
+  unsigned long nanc;
+  struct dir_id *anc;
+  char path[];
+};
+
+struct scan {
+  const struct mydu_opts *opts;
+  struct cache_header *cache;
+  int cache_fd; // Holds the cache's LOCK_SH
+  struct exclude *exclude;
+  unsigned long root_dev;
+  int stop; // Set once by the first error or cancellation
+  int err;
+  struct mydu_usage total;
+  struct memo memo;
+
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int nthreads;
+  struct task *tasks;
+  unsigned long queued;
+  unsigned long pending; // Queued or running
+  struct join *joins;
+  int done;
+};
+
+struct walk {
+  struct scan *scan;
+  struct frame *stack;
+  unsigned long depth;
+  unsigned long cap;
+  struct join *parent; // Where stack[0]'s total goes; NULL for the root
+  struct dir_id *anc;  // Directories above stack[0]
+  unsigned long nanc;  // Also the depth of stack[0] below the scan root
+  char *path;
+  unsigned long path_cap;
+  struct mydu_stats ctr; // Not yet added to opts->stats
+  unsigned long unflushed;
+};
+
+static void scan_fail(struct scan *s, int err) {
+  int expected = 0;
+  if (__atomic_compare_exchange_n(&s->stop, &expected, 1, 0, __ATOMIC_RELAXED,
+                                  __ATOMIC_RELAXED))
+    s->err = err;
+}
+
+static int scan_stopped(struct scan *s) {
+  if (__atomic_load_n(&s->stop, __ATOMIC_RELAXED))
+    return 1;
+  if (s->opts->cancel != NULL && *s->opts->cancel) {
+    scan_fail(s, ECANCELED);
+    return 1;
+  }
+  return 0;
+}
+
+static int walk_path_reserve(struct walk *w, unsigned long len) {
+  if (len < w->path_cap)
+    return 0;
+  unsigned long cap = w->path_cap;
+  while (cap <= len)
+    cap = cap ? cap * 2 : 4096;
+  char *path = realloc(w->path, cap);
+  if (path == NULL) {
+    scan_fail(w->scan, ENOMEM);
+    return -1;
+  }
+  w->path = path;
+  w->path_cap = cap;
+  return 0;
+}
+
+// Extend the path of the top frame with "/name", without moving path_len.
+static char *walk_path_at(struct walk *w, const char *name) {
+  struct frame *f = &w->stack[w->depth - 1];
+  unsigned long nlen = strlen(name);
+  if (walk_path_reserve(w, f->path_len + nlen + 1) < 0)
+    return NULL;
+  w->path[f->path_len] = '/';
+  memcpy(w->path + f->path_len + 1, name, nlen + 1);
+  return w->path;
+}
+
+#define STATS_FLUSH 4096
+
+// Monotonic nanoseconds, or 0 when nobody is counting.
+static unsigned long walk_clock(struct walk *w) {
+  if (w->scan->opts->stats == NULL)
+    return 0;
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+// Add this thread's counters to the caller's.
+static void walk_flush(struct walk *w) {
+  struct mydu_stats *out = w->scan->opts->stats;
+  w->unflushed = 0;
+  if (out == NULL)
+    return;
+  __atomic_add_fetch(&out->dirs, w->ctr.dirs, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&out->entries, w->ctr.entries, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&out->stats, w->ctr.stats, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&out->bytes, w->ctr.bytes, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&out->errors, w->ctr.errors, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&out->open_ns, w->ctr.open_ns, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&out->read_ns, w->ctr.read_ns, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&out->stat_ns, w->ctr.stat_ns, __ATOMIC_RELAXED);
+  memset(&w->ctr, 0, sizeof(w->ctr));
+}
+
+// fstatat(), or fstat() of dfd when name is NULL, counted and timed.
+static int walk_stat(struct walk *w, int dfd, const char *name,
+                     struct stat *st, int flags) {
+  unsigned long start = walk_clock(w);
+  int ret = name == NULL ? fstat(dfd, st) : fstatat(dfd, name, st, flags);
+  w->ctr.stat_ns += walk_clock(w) - start;
+  w->ctr.stats++;
+  return ret;
+}
+
+static int walk_openat(struct walk *w, int dfd, const char *name, int flags) {
+  unsigned long start = walk_clock(w);
+  int fd = openat(dfd, name, flags);
+  w->ctr.open_ns += walk_clock(w) - start;
+  return fd;
+}
+
+static DIR *walk_fdopendir(struct walk *w, int fd) {
+  unsigned long start = walk_clock(w);
+  DIR *dir = fdopendir(fd);
+  w->ctr.open_ns += walk_clock(w) - start;
+  return dir;
+}
+
+static void walk_closedir(struct walk *w, DIR *dir) {
+  unsigned long start = walk_clock(w);
+  closedir(dir);
+  w->ctr.open_ns += walk_clock(w) - start;
+}
+
+/*
+ * An entry of the top frame could not be read. Returns -1 if that ends the
+ * scan; with keep_going it is noted on the directory instead and the walk
+ * moves on to the next entry.
+ */
+static int walk_error(struct walk *w, int err) {
+  w->ctr.errors++;
+  if (!w->scan->opts->keep_going || err == ENOMEM) {
+    scan_fail(w->scan, err);
+    return -1;
+  }
+  w->stack[w->depth - 1].flags |= FRAME_ERROR | FRAME_INCOMPLETE;
+  return 0;
+}
+
+static void scan_emit(struct scan *s, mydu_entry_fn fn, const char *path,
+                      const struct mydu_usage *usage, unsigned long depth,
+                      int flags) {
+  struct mydu_entry entry;
+  entry.path = path;
+  entry.size = usage->size;
+  entry.usage = usage;
+  entry.depth = depth;
+  entry.flags = (flags & FRAME_LINKED ? MYDU_LINKED : 0) |
+                (flags & FRAME_ERROR ? MYDU_ERROR : 0) |
+                (flags & FRAME_INCOMPLETE ? MYDU_INCOMPLETE : 0);
+  if (fn(&entry, s->opts->arg) != 0)
+    scan_fail(s, ECANCELED);
+}
+
+// A directory and everything below it has been summed.
+static void scan_dir_done(struct scan *s, const char *path,
+                          struct cache_key *key, struct mydu_usage *own,
+                          struct mydu_usage *total, unsigned long depth,
+                          int flags) {
+  if (!(flags & (FRAME_CACHED | FRAME_ERROR)))
+    cache_put(s->cache, key, own);
+  if ((flags & (FRAME_LINK_ROOT | FRAME_INHERITED)) == FRAME_LINK_ROOT)
+    memo_put(&s->memo, key, total);
+  if (s->opts->on_dir != NULL)
+    scan_emit(s, s->opts->on_dir, path, total, depth, flags);
+  if (depth == 0)
+    s->total = *total;
+}
+
+static struct join *join_new(struct scan *s) {
+  struct join *j = calloc(1, sizeof(struct join));
+  if (j == NULL) {
+    scan_fail(s, ENOMEM);
+    return NULL;
+  }
+  j->pending = 1;
+  pthread_mutex_lock(&s->lock);
+  j->next = s->joins;
+  if (s->joins != NULL)
+    s->joins->prev = j;
+  s->joins = j;
+  pthread_mutex_unlock(&s->lock);
+  return j;
+}
+
+static void join_free(struct scan *s, struct join *j) {
+  pthread_mutex_lock(&s->lock);
+  if (j->prev != NULL)
+    j->prev->next = j->next;
+  else
+    s->joins = j->next;
+  if (j->next != NULL)
+    j->next->prev = j->prev;
+  pthread_mutex_unlock(&s->lock);
+  free(j->path);
+  free(j);
+}
+
+// Deliver one contribution to j, completing it and its ancestors as needed.
+static void join_add(struct scan *s, struct join *j,
+                     const struct mydu_usage *usage, int flags) {
+  struct mydu_usage total;
+  while (j != NULL) {
+    usage_add_atomic(&j->sub, usage);
+    if (flags & FRAME_INHERITED)
+      __atomic_or_fetch(&j->inherited, flags & FRAME_INHERITED,
+                        __ATOMIC_RELAXED);
+    if (__atomic_sub_fetch(&j->pending, 1, __ATOMIC_ACQ_REL) != 0)
+      return;
+    total = j->base;
+    usage_add(&total, &j->sub);
+    usage = &total;
+    flags = j->flags | j->inherited;
+    scan_dir_done(s, j->path, &j->key, &j->own, &total, j->depth, flags);
+    struct join *parent = j->parent;
+    join_free(s, j);
+    j = parent;
+  }
+}
+
+static struct join *frame_join(struct walk *w, struct frame *f) {
+  if (f->join == NULL)
+    f->join = join_new(w->scan);
+  return f->join;
+}
+
+// Push the directory open at fd, whose path is w->path[0, path_len).
+static int walk_push(struct walk *w, int fd, struct stat *dirst,
+                     unsigned long path_len, int flags) {
+  struct scan *s = w->scan;
+  if (w->depth == w->cap) {
+    unsigned long cap = w->cap ? w->cap * 2 : 64;
+    struct frame *stack = realloc(w->stack, cap * sizeof(struct frame));
+    if (stack == NULL) {
+      close(fd);
+      scan_fail(s, ENOMEM);
+      return -1;
+    }
+    w->stack = stack;
+    w->cap = cap;
+  }
+  struct frame *f = &w->stack[w->depth];
+  f->nread = 0;
+  if ((f->dir = walk_fdopendir(w, fd)) == NULL) {
+    scan_fail(s, errno);
+    close(fd);
+    return -1;
+  }
+  f->batch = NULL;
+  if (s->opts->inode_order) {
+    unsigned long start = walk_clock(w);
+    f->batch = batch_fill(f->dir);
+    w->ctr.read_ns += walk_clock(w) - start;
+    if (f->batch == NULL) {
+      scan_fail(s, ENOMEM);
+      walk_closedir(w, f->dir);
+      return -1;
+    }
+  }
+  w->depth++;
+  w->ctr.dirs++;
+  f->join = NULL;
+  cache_key_of(dirst, &f->key);
+  usage_of(dirst, &f->own);
+  memset(&f->sub, 0, sizeof(f->sub));
+  f->path_len = path_len;
+  f->flags = flags & (FRAME_LINKED | FRAME_LINK_ROOT);
+  // A file callback needs every file's usage.
+  if (s->opts->on_file == NULL && cache_get(s->cache, &f->key, &f->own))
+    f->flags |= FRAME_CACHED;
+  w->ctr.bytes += f->own.size;
+
+  if (w->depth > FD_BUDGET) {
+    // It may still be parked from an earlier, deeper descent.
+    struct frame *old = &w->stack[w->depth - 1 - FD_BUDGET];
+    if (old->dir != NULL) {
+      walk_closedir(w, old->dir);
+      old->dir = NULL;
+    }
+  }
+  return 0;
+}
+
+static int walk_unpark(struct walk *w, struct frame *f, int child_fd) {
+  struct stat st;
+  int fd = walk_openat(w, child_fd, "..", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd >= 0 && (walk_stat(w, fd, NULL, &st, 0) < 0 ||
+                  st.st_dev != f->key.dev || st.st_ino != f->key.ino)) {
+    // The child was entered through a symlink or moved; go by path.
+    close(fd);
+    fd = -1;
+  }
+  if (fd < 0) {
+    char saved = w->path[f->path_len];
+    w->path[f->path_len] = '\0';
+    fd = walk_openat(w, AT_FDCWD, w->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    w->path[f->path_len] = saved;
+  }
+  if (fd < 0 || (f->dir = walk_fdopendir(w, fd)) == NULL) {
+    scan_fail(w->scan, errno);
+    if (fd >= 0)
+      close(fd);
+    return -1;
+  }
+  for (unsigned long i = 0; i < f->nread && readdir(f->dir) != NULL; i++)
+    ;
+  return 0;
+}
+
+static void walk_close(struct walk *w, struct frame *f) {
+  if (f->dir != NULL)
+    walk_closedir(w, f->dir);
+  batch_free(f->batch);
+}
+
+// Pop the finished top frame and pass its total to whoever is above it.
+static void walk_pop(struct walk *w) {
+  struct scan *s = w->scan;
+  struct frame *f = &w->stack[--w->depth];
+  struct frame *parent = w->depth > 0 ? f - 1 : NULL;
+  struct mydu_usage total = f->own;
+  usage_add(&total, &f->sub);
+  w->path[f->path_len] = '\0';
+  if (parent != NULL && parent->dir == NULL)
+    walk_unpark(w, parent, dirfd(f->dir));
+
+  struct join *j = f->join;
+  if (j == NULL) {
+    scan_dir_done(s, w->path, &f->key, &f->own, &total, w->nanc + w->depth,
+                  f->flags);
+    if (parent != NULL) {
+      usage_add(&parent->sub, &total);
+      parent->flags |= f->flags & FRAME_INHERITED;
+    } else if (w->parent != NULL) {
+      join_add(s, w->parent, &total, f->flags);
+    }
+  } else {
+    // Part of this subtree is still being summed elsewhere.
+    j->key = f->key;
+    j->own = f->own;
+    j->base = total;
+    j->depth = w->nanc + w->depth;
+    j->flags = f->flags;
+    j->path = strdup(w->path);
+    if (j->path == NULL)
+      scan_fail(s, ENOMEM);
+    if (parent == NULL) {
+      j->parent = w->parent;
+    } else if ((j->parent = frame_join(w, parent)) != NULL) {
+      __atomic_add_fetch(&j->parent->pending, 1, __ATOMIC_RELAXED);
+    }
+    if (!scan_stopped(s)) {
+      struct mydu_usage none = {0, 0, 0, 0};
+      join_add(s, j, &none, 0);
+    }
+  }
+  walk_close(w, f);
+}
+
+// Next entry of the top frame other than "." and "..", or NULL at the end.
+static char *walk_next(struct walk *w, struct frame *f, unsigned char *type) {
+  if (f->batch != NULL) {
+    if (f->batch->next == f->batch->n)
+      return NULL;
+    struct batch_ent *e = &f->batch->ents[f->batch->next++];
+    w->ctr.entries++;
+    *type = e->type;
+    return f->batch->names + e->name_off;
+  }
+  unsigned long start = walk_clock(w);
+  struct dirent *md_iter;
+  while ((md_iter = readdir(f->dir)) != NULL) {
+    f->nread++;
+    if (is_dot(md_iter->d_name))
+      continue;
+    w->ctr.read_ns += walk_clock(w) - start;
+    w->ctr.entries++;
+    *type = md_iter->d_type;
+    return md_iter->d_name;
+  }
+  w->ctr.read_ns += walk_clock(w) - start;
+  return NULL;
+}
+
+// Open name (in dfd) as a directory to descend into, or return -1 to skip.
+static int walk_open_child(struct walk *w, int dfd, const char *name,
+                           int nofollow, struct stat *st) {
+  struct scan *s = w->scan;
+  int oflags = O_RDONLY | O_DIRECTORY | O_CLOEXEC;
+  if (nofollow)
+    oflags |= O_NOFOLLOW;
+  int fd;
+  if (s->opts->one_filesystem) {
+    // Check the device before opening, so a foreign (possibly hung or
+    // synthetic) mount is never touched beyond its mount point's stat.
+    if (walk_stat(w, dfd, name, st, nofollow ? AT_SYMLINK_NOFOLLOW : 0) < 0) {
+      walk_error(w, errno);
+      return -1;
+    }
+    if ((unsigned long)st->st_dev != s->root_dev)
+      return -1;
+    if ((fd = walk_openat(w, dfd, name, oflags)) < 0)
+      walk_error(w, errno);
+    return fd;
+  }
+  fd = walk_openat(w, dfd, name, oflags);
+  if (fd < 0 || walk_stat(w, fd, NULL, st, 0) < 0) {
+    walk_error(w, errno);
+    if (fd >= 0)
+      close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static int scan_should_spawn(struct scan *s, struct stat *st) {
+  unsigned long queued = __atomic_load_n(&s->queued, __ATOMIC_RELAXED);
+  if (s->nthreads < 2 || queued >= (unsigned long)s->nthreads)
+    return 0;
+  return st->st_nlink > 2 || st->st_size > 4096;
+}
+
+// Hand the directory open at fd (path in w->path) to the queue.
+static void scan_spawn(struct walk *w, int fd, int flags) {
+  struct scan *s = w->scan;
+  unsigned long len = strlen(w->path);
+  unsigned long nanc = w->nanc + w->depth;
+  struct task *t = malloc(sizeof(struct task) + len + 1);
+  struct dir_id *anc = malloc(nanc * sizeof(struct dir_id));
+  struct join *parent = frame_join(w, &w->stack[w->depth - 1]);
+  if (t == NULL || anc == NULL || parent == NULL) {
+    free(t);
+    free(anc);
+    close(fd);
+    scan_fail(s, ENOMEM);
+    return;
+  }
+  memcpy(t->path, w->path, len + 1);
+  if (w->nanc > 0)
+    memcpy(anc, w->anc, w->nanc * sizeof(struct dir_id));
+  for (unsigned long i = 0; i < w->depth; i++) {
+    anc[w->nanc + i].dev = w->stack[i].key.dev;
+    anc[w->nanc + i].ino = w->stack[i].key.ino;
+  }
+  t->fd = fd;
+  t->flags = flags;
+  t->parent = parent;
+  t->nanc = nanc;
+  t->anc = anc;
+  __atomic_add_fetch(&parent->pending, 1, __ATOMIC_RELAXED);
+
+  pthread_mutex_lock(&s->lock);
+  t->next = s->tasks;
+  s->tasks = t;
+  __atomic_add_fetch(&s->queued, 1, __ATOMIC_RELAXED);
+  s->pending++;
+  pthread_cond_signal(&s->cond);
+  pthread_mutex_unlock(&s->lock);
+}
+
+/*
+ * Walk the tree open at fd, named basedir, which sits below the nanc
+ * directories in anc; its total goes to parent (NULL for the scan root).
+ */
+static void walk_tree(struct scan *s, int fd, const char *basedir,
+                      struct dir_id *anc, unsigned long nanc,
+                      struct join *parent, int flags) {
+  struct walk w;
+  memset(&w, 0, sizeof(w));
+  w.scan = s;
+  w.parent = parent;
+  w.anc = anc;
+  w.nanc = nanc;
+  unsigned long blen = strlen(basedir);
+  struct stat dirst;
+  if (walk_path_reserve(&w, blen) < 0 ||
+      walk_stat(&w, fd, NULL, &dirst, 0) < 0) {
+    scan_fail(s, errno);
+    close(fd);
+    free(w.path);
+    return;
+  }
+  memcpy(w.path, basedir, blen + 1);
+  walk_push(&w, fd, &dirst, blen, flags);
+
+  const struct mydu_opts *opts = s->opts;
+  while (w.depth > 0 && !scan_stopped(s)) {
+    struct frame *f = &w.stack[w.depth - 1];
+    unsigned char type;
+    char *name = walk_next(&w, f, &type);
+    if (name == NULL) {
+      walk_pop(&w);
+      continue;
+    }
+    if (++w.unflushed == STATS_FLUSH)
+      walk_flush(&w);
+
+    if (s->exclude != NULL) {
+      char *path = NULL;
+      if (s->exclude->has_path && (path = walk_path_at(&w, name)) == NULL)
+        break;
+      if (exclude_match(s->exclude, name, path))
+        continue;
+    }
+
+    int dfd = dirfd(f->dir);
+    struct stat filest;
+    struct mydu_usage usage;
+    int have_lstat = 0;
+    if (type == DT_UNKNOWN) {
+      if (walk_stat(&w, dfd, name, &filest, AT_SYMLINK_NOFOLLOW) < 0) {
+        if (walk_error(&w, errno) < 0)
+          break;
+        continue;
+      }
+      have_lstat = 1;
+      type = S_ISDIR(filest.st_mode)   ? DT_DIR
+             : S_ISREG(filest.st_mode) ? DT_REG
+             : S_ISLNK(filest.st_mode) ? DT_LNK
+                                       : DT_UNKNOWN;
+    }
+
+    int child_flags = f->flags & FRAME_LINKED;
+    int nofollow = 1;
+    if (type == DT_REG) {
+      if (f->flags & FRAME_CACHED)
+        continue;
+      if (!have_lstat &&
+          walk_stat(&w, dfd, name, &filest, AT_SYMLINK_NOFOLLOW) < 0) {
+        if (walk_error(&w, errno) < 0)
+          break;
+        continue;
+      }
+      usage_of(&filest, &usage);
+      usage_add(&f->own, &usage);
+      w.ctr.bytes += usage.size;
+      if (opts->on_file != NULL) {
+        if (walk_path_at(&w, name) == NULL)
+          break;
+        scan_emit(s, opts->on_file, w.path, &usage, w.nanc + w.depth,
+                  f->flags);
+      }
+      continue;
+    } else if (type == DT_LNK) {
+      if (!opts->follow_symlinks) {
+        if (!have_lstat &&
+            walk_stat(&w, dfd, name, &filest, AT_SYMLINK_NOFOLLOW) < 0) {
+          if (walk_error(&w, errno) < 0)
+            break;
+          continue;
+        }
+        usage_of(&filest, &usage);
+        usage_add(&f->sub, &usage);
+        w.ctr.bytes += usage.size;
+        continue;
+      }
+      // A linked directory is walked as part of this one unless it is one
+      // of our own ancestors.
+      if (walk_stat(&w, dfd, name, &filest, 0) < 0) {
+        if (walk_error(&w, errno) < 0)
+          break;
+        continue;
+      }
+      if (!S_ISDIR(filest.st_mode)) {
+        usage_of(&filest, &usage);
+        usage_add(&f->sub, &usage);
+        w.ctr.bytes += usage.size;
+        if (opts->on_file != NULL) {
+          if (walk_path_at(&w, name) == NULL)
+            break;
+          scan_emit(s, opts->on_file, w.path, &usage, w.nanc + w.depth,
+                    f->flags | FRAME_LINKED);
+        }
+        continue;
+      }
+      int cycle = 0;
+      for (unsigned long i = 0; i < w.depth; i++)
+        if (w.stack[i].key.dev == (unsigned long)filest.st_dev &&
+            w.stack[i].key.ino == (unsigned long)filest.st_ino)
+          cycle = 1;
+      for (unsigned long i = 0; i < w.nanc; i++)
+        if (w.anc[i].dev == (unsigned long)filest.st_dev &&
+            w.anc[i].ino == (unsigned long)filest.st_ino)
+          cycle = 1;
+      if (cycle) {
+        f->flags |= FRAME_TAINTED;
+        continue;
+      }
+      if (opts->on_file == NULL && memo_get(&s->memo, &filest, &usage)) {
+        usage_add(&f->sub, &usage);
+        w.ctr.bytes += usage.size;
+        if (opts->on_dir != NULL) {
+          if (walk_path_at(&w, name) == NULL)
+            break;
+          scan_emit(s, opts->on_dir, w.path, &usage, w.nanc + w.depth,
+                    FRAME_LINKED);
+        }
+        continue;
+      }
+      child_flags |= FRAME_LINKED | FRAME_LINK_ROOT;
+      nofollow = 0;
+    } else if (type != DT_DIR) {
+      continue;
+    }
+
+    int cfd = walk_open_child(&w, dfd, name, nofollow, &filest);
+    if (cfd < 0)
+      continue;
+    if (walk_path_at(&w, name) == NULL) {
+      close(cfd);
+      break;
+    }
+    if (scan_should_spawn(s, &filest))
+      scan_spawn(&w, cfd, child_flags);
+    else
+      walk_push(&w, cfd, &filest, f->path_len + 1 + strlen(name), child_flags);
+  }
+
+  // Unwind whatever a failure or cancellation left open.
+  while (w.depth > 0)
+    walk_close(&w, &w.stack[--w.depth]);
+  walk_flush(&w);
+  free(w.stack);
+  free(w.path);
+}
+
+static void walk_run_task(struct scan *s, struct task *t) {
+  if (scan_stopped(s))
+    close(t->fd);
+  else
+    walk_tree(s, t->fd, t->path, t->anc, t->nanc, t->parent, t->flags);
+  free(t->anc);
+  free(t);
+}
+
+// Take the next queued task; called and returns with s->lock held.
+static struct task *scan_take(struct scan *s) {
+  struct task *t = s->tasks;
+  if (t != NULL) {
+    s->tasks = t->next;
+    __atomic_sub_fetch(&s->queued, 1, __ATOMIC_RELAXED);
+  }
+  return t;
+}
+
+static void scan_finish_task(struct scan *s) {
+  if (--s->pending == 0)
+    pthread_cond_broadcast(&s->cond);
+}
+
+static void *scan_worker(void *arg) {
+  struct scan *s = arg;
+  pthread_mutex_lock(&s->lock);
+  while (!s->done) {
+    struct task *t = scan_take(s);
+    if (t == NULL) {
+      pthread_cond_wait(&s->cond, &s->lock);
+      continue;
+    }
+    pthread_mutex_unlock(&s->lock);
+    walk_run_task(s, t);
+    pthread_mutex_lock(&s->lock);
+    scan_finish_task(s);
+  }
+  pthread_mutex_unlock(&s->lock);
+  return NULL;
+}
+
+// Work through the queue on the calling thread until every task is done.
+static void scan_drain(struct scan *s) {
+  pthread_mutex_lock(&s->lock);
+  while (s->pending > 0) {
+    struct task *t = scan_take(s);
+    if (t == NULL) {
+      pthread_cond_wait(&s->cond, &s->lock);
+      continue;
+    }
+    pthread_mutex_unlock(&s->lock);
+    walk_run_task(s, t);
+    pthread_mutex_lock(&s->lock);
+    scan_finish_task(s);
+  }
+  pthread_mutex_unlock(&s->lock);
+}
+
+void mydu_opts_init(struct mydu_opts *opts) {
+  memset(opts, 0, sizeof(*opts));
+  opts->follow_symlinks = 1;
+}
+
+int mydu_scan_usage(const char *root, const struct mydu_opts *opts,
+                    struct mydu_usage *total) {
+  struct scan s;
+  memset(&s, 0, sizeof(s));
+  s.opts = opts;
+  s.nthreads = opts->threads;
+  if (s.nthreads <= 0)
+    s.nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (s.nthreads < 1)
+    s.nthreads = 1;
+
+  int fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  struct stat rootst;
+  if (fd < 0)
+    return -1;
+  if (fstat(fd, &rootst) < 0) {
+    close(fd);
+    return -1;
+  }
+  s.root_dev = rootst.st_dev;
+  s.exclude = exclude_compile(opts->exclude);
+  if (s.exclude == NULL && errno != 0) {
+    close(fd);
+    return -1;
+  }
+  // Cached own sizes do not record which files were excluded.
+  if (opts->cache_path != NULL && s.exclude == NULL &&
+      (s.cache = cache_open(opts->cache_path, &s.cache_fd)) == NULL) {
+    free(s.exclude);
+    close(fd);
+    return -1;
+  }
+  pthread_mutex_init(&s.lock, NULL);
+  pthread_cond_init(&s.cond, NULL);
+  pthread_mutex_init(&s.memo.lock, NULL);
+
+  // The calling thread is one of the workers.
+  pthread_t *workers = malloc(s.nthreads * sizeof(pthread_t));
+  int nworkers = 0;
+  while (workers != NULL && nworkers < s.nthreads - 1 &&
+         pthread_create(&workers[nworkers], NULL, scan_worker, &s) == 0)
+    nworkers++;
+  s.nthreads = nworkers + 1;
+
+  walk_tree(&s, fd, root, NULL, 0, NULL, 0);
+  scan_drain(&s);
+
+  pthread_mutex_lock(&s.lock);
+  s.done = 1;
+  pthread_cond_broadcast(&s.cond);
+  pthread_mutex_unlock(&s.lock);
+  for (int i = 0; i < nworkers; i++)
+    pthread_join(workers[i], NULL);
+  free(workers);
+  // Left behind only when the scan stopped early.
+  while (s.joins != NULL)
+    join_free(&s, s.joins);
+  pthread_cond_destroy(&s.cond);
+  pthread_mutex_destroy(&s.lock);
+  pthread_mutex_destroy(&s.memo.lock);
+  free(s.memo.slots);
+  if (s.cache != NULL) {
+    cache_unmap(s.cache);
+    close(s.cache_fd);
+  }
+  free(s.exclude);
+
+  if (s.stop) {
+    errno = s.err;
+    return -1;
+  }
+  *total = s.total;
+  return 0;
+}
+
+int mydu_scan(const char *root, const struct mydu_opts *opts,
+              unsigned long *total) {
+  struct mydu_usage usage;
+  if (mydu_scan_usage(root, opts, &usage) < 0)
+    return -1;
+  *total = usage.size;
+  return 0;
+}
+
+/*
+ * Size estimation, after Knuth's estimator for backtrack trees. A probe
+ * starts at a directory, reads it, picks one subdirectory uniformly at
+ * random and carries on down to a leaf; a directory reached through
+ * branching factors b1, b2, ... stands for b1 * b2 * ... directories like
+ * it, so adding each one's own usage times that weight gives an unbiased
+ * estimate of the subtree. Its variance comes from lopsided trees, so the
+ * top of the tree is not sampled at all: levels are read exactly, breadth
+ * first, until the frontier holds EST_STRATA directories (or a tenth of the
+ * budget is spent, which may leave part of a level unread in the frontier).
+ * The frontier, shuffled, is then cut into at most EST_STRATA strata; a
+ * probe of a stratum starts at one of its directories picked at random,
+ * weighted by their number. Strata are probed round robin until the budget
+ * is spent; the estimate is the exact part plus the strata's means, and the
+ * strata's sample variances give the confidence interval. If the budget
+ * ends before every stratum has EST_MIN_PROBES probes, the strata probed so
+ * far, a random subset, give a ratio estimate for the whole frontier.
+ *
+ * Directories are read with the batch reader, once: a node tree caches
+ * each one's own usage and subdirectories for later probes, and holds only
+ * names, so memory grows with the directories read, not with their depth.
+ * Links to directories are not followed, so a tree holding any is never
+ * reported as exact.
+ */
+#define EST_STRATA 256
+#define EST_MIN_PROBES 2 // Per stratum, so each has a variance
+
+struct enode {
+  struct enode *next;   // Every node, for freeing
+  struct enode *parent; // NULL for the root
+  const char *name;     // In the parent's batch; the root's path
+  int read;
+  struct mydu_usage own;
+  struct dir_batch *batch;
+  unsigned long nkids;
+  unsigned long *kid_ent; // Batch entries that are subdirectories
+  struct enode **kids;    // Created on first visit
+};
+
+struct estimator {
+  const struct mydu_opts *opts;
+  struct exclude *exclude;
+  unsigned long root_dev;
+  double start;
+  double seconds;
+  unsigned long max_entries;
+  unsigned long entries;
+  unsigned long revisits; // Entries probes went over again, from the tree
+  unsigned long links_skipped; // Links to directories left out
+  unsigned long rng;
+  struct enode *nodes;
+  struct enode **chain; // Scratch for enode_open() and est_path()
+  unsigned long chain_cap;
+  char *path;
+  unsigned long path_cap;
+};
+
+static double est_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Whether at least fraction of the budget has been spent. Entries taken
+// from the node tree count too, or probes that only retrace read paths
+// would never use up an entry budget.
+static int est_spent(struct estimator *e, double fraction) {
+  if (e->max_entries > 0 &&
+      e->entries + e->revisits >= e->max_entries * fraction)
+    return 1;
+  return e->seconds > 0 && est_now() - e->start >= e->seconds * fraction;
+}
+
+static unsigned long est_rand(struct estimator *e) {
+  e->rng ^= e->rng << 13;
+  e->rng ^= e->rng >> 7;
+  e->rng ^= e->rng << 17;
+  return e->rng;
+}
+
+// Newton's method; keeps the build free of libm.
+static double est_sqrt(double x) {
+  if (x <= 0)
+    return 0;
+  double r = x > 1 ? x : 1;
+  for (int i = 0; i < 64; i++)
+    r = (r + x / r) / 2;
+  return r;
+}
+
+static struct enode *enode_new(struct estimator *e, struct enode *parent,
+                               const char *name) {
+  struct enode *n = calloc(1, sizeof(struct enode));
+  if (n == NULL)
+    return NULL;
+  n->parent = parent;
+  n->name = name;
+  n->next = e->nodes;
+  e->nodes = n;
+  return n;
+}
+
+// n's ancestors from the root down, n last; returns how many, 0 on ENOMEM.
+static unsigned long est_chain(struct estimator *e, struct enode *n) {
+  unsigned long len = 0;
+  for (struct enode *p = n; p != NULL; p = p->parent)
+    len++;
+  if (len > e->chain_cap) {
+    struct enode **chain = realloc(e->chain, len * sizeof(struct enode *));
+    if (chain == NULL)
+      return 0;
+    e->chain = chain;
+    e->chain_cap = len;
+  }
+  unsigned long i = len;
+  for (struct enode *p = n; p != NULL; p = p->parent)
+    e->chain[--i] = p;
+  return len;
+}
+
+/*
+ * Open n's directory one level at a time, as the walk does, so depth is
+ * not limited by PATH_MAX.
+ */
+static int enode_open(struct estimator *e, struct enode *n) {
+  unsigned long len = est_chain(e, n);
+  if (len == 0)
+    return -1;
+  int fd = open(e->chain[0]->name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  for (unsigned long i = 1; i < len && fd >= 0; i++) {
+    int cfd = openat(fd, e->chain[i]->name,
+                     O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    close(fd);
+    fd = cfd;
+  }
+  return fd;
+}
+
+// Full path of name inside n, for exclusion patterns that need one.
+static char *est_path(struct estimator *e, struct enode *n, const char *name) {
+  unsigned long len = est_chain(e, n), plen = strlen(name) + 1;
+  if (len == 0)
+    return NULL;
+  for (unsigned long i = 0; i < len; i++)
+    plen += strlen(e->chain[i]->name) + 1;
+  if (plen > e->path_cap) {
+    char *path = realloc(e->path, plen);
+    if (path == NULL)
+      return NULL;
+    e->path = path;
+    e->path_cap = plen;
+  }
+  char *p = e->path;
+  for (unsigned long i = 0; i < len; i++) {
+    unsigned long nlen = strlen(e->chain[i]->name);
+    memcpy(p, e->chain[i]->name, nlen);
+    p[nlen] = '/';
+    p += nlen + 1;
+  }
+  strcpy(p, name);
+  return e->path;
+}
+
+/*
+ * Read n, open at fd, once; fd stays open for the caller. An unreadable
+ * directory counts as empty.
+ */
+static void enode_read(struct estimator *e, struct enode *n, int fd) {
+  n->read = 1;
+  struct stat st;
+  DIR *dir;
+  int dfd = fd < 0 ? -1 : dup(fd);
+  if (dfd < 0)
+    return;
+  if (fstat(dfd, &st) < 0 || (dir = fdopendir(dfd)) == NULL) {
+    close(dfd);
+    return;
+  }
+  usage_of(&st, &n->own);
+  n->batch = batch_fill(dir);
+  closedir(dir);
+  if (n->batch == NULL ||
+      (n->kid_ent = malloc(n->batch->n * sizeof(unsigned long))) == NULL)
+    return;
+  e->entries += n->batch->n;
+
+  const struct mydu_opts *opts = e->opts;
+  struct mydu_usage usage;
+  for (unsigned long i = 0; i < n->batch->n; i++) {
+    struct batch_ent *ent = &n->batch->ents[i];
+    char *name = n->batch->names + ent->name_off;
+    if (e->exclude != NULL) {
+      char *path = NULL;
+      if (e->exclude->has_path && (path = est_path(e, n, name)) == NULL)
+        continue;
+      if (exclude_match(e->exclude, name, path))
+        continue;
+    }
+    unsigned char type = ent->type;
+    int have_lstat = 0;
+    if (type == DT_UNKNOWN || (type == DT_DIR && opts->one_filesystem)) {
+      if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+        continue;
+      have_lstat = 1;
+      type = S_ISDIR(st.st_mode)   ? DT_DIR
+             : S_ISREG(st.st_mode) ? DT_REG
+             : S_ISLNK(st.st_mode) ? DT_LNK
+                                   : DT_UNKNOWN;
+    }
+    if (type == DT_DIR) {
+      if (!opts->one_filesystem || (unsigned long)st.st_dev == e->root_dev)
+        n->kid_ent[n->nkids++] = i;
+      continue;
+    }
+    if (type == DT_REG || (type == DT_LNK && !opts->follow_symlinks)) {
+      if (!have_lstat && fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+        continue;
+    } else if (type == DT_LNK) {
+      if (fstatat(fd, name, &st, 0) < 0)
+        continue;
+      if (S_ISDIR(st.st_mode)) {
+        e->links_skipped++;
+        continue;
+      }
+    } else {
+      continue;
+    }
+    usage_of(&st, &usage);
+    usage_add(&n->own, &usage);
+  }
+  n->kids = calloc(n->nkids, sizeof(struct enode *));
+  if (n->kids == NULL)
+    n->nkids = 0;
+}
+
+static struct enode *enode_kid(struct estimator *e, struct enode *n,
+                               unsigned long i) {
+  if (n->kids[i] == NULL) {
+    struct batch_ent *ent = &n->batch->ents[n->kid_ent[i]];
+    n->kids[i] = enode_new(e, n, n->batch->names + ent->name_off);
+  }
+  return n->kids[i];
+}
+
+/*
+ * One probe from stratum s; y gets size, alloc, files and dirs. Directories
+ * read before are taken from the node tree; a run of new ones is opened
+ * level by level from the last.
+ */
+static void est_probe(struct estimator *e, struct enode *s, double *y) {
+  double w = 1;
+  int fd = -1;
+  struct enode *fd_node = NULL;
+  memset(y, 0, 4 * sizeof(double));
+  for (struct enode *n = s; n != NULL;) {
+    if (!n->read) {
+      int nfd = fd_node != NULL && fd_node == n->parent
+                    ? openat(fd, n->name,
+                             O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)
+                    : enode_open(e, n);
+      if (fd >= 0)
+        close(fd);
+      fd = nfd;
+      fd_node = n;
+      enode_read(e, n, fd);
+    } else if (n->batch != NULL) {
+      e->revisits += n->batch->n;
+    }
+    y[0] += w * n->own.size;
+    y[1] += w * n->own.alloc;
+    y[2] += w * n->own.files;
+    y[3] += w * n->own.dirs;
+    if (n->nkids == 0)
+      break;
+    unsigned long i = est_rand(e) % n->nkids;
+    w *= n->nkids;
+    n = enode_kid(e, n, i);
+  }
+  if (fd >= 0)
+    close(fd);
+}
+
+/*
+ * Sum the subtree at n if every directory in it has been read already;
+ * returns 0 if not.
+ */
+static int enode_sum(struct enode *n, double *sum) {
+  unsigned long depth = 0, cap = 64;
+  struct enode **stack = malloc(cap * sizeof(struct enode *));
+  int complete = stack != NULL;
+  memset(sum, 0, 4 * sizeof(double));
+  if (complete)
+    stack[depth++] = n;
+  while (complete && depth > 0) {
+    n = stack[--depth];
+    if (!n->read) {
+      complete = 0;
+      break;
+    }
+    sum[0] += n->own.size;
+    sum[1] += n->own.alloc;
+    sum[2] += n->own.files;
+    sum[3] += n->own.dirs;
+    for (unsigned long i = 0; i < n->nkids && complete; i++) {
+      if (n->kids[i] == NULL) {
+        complete = 0;
+      } else if (depth == cap) {
+        struct enode **grown = realloc(stack, 2 * cap * sizeof(*stack));
+        if (grown == NULL)
+          complete = 0;
+        stack = grown != NULL ? grown : stack;
+        cap *= 2;
+      }
+      if (complete)
+        stack[depth++] = n->kids[i];
+    }
+  }
+  free(stack);
+  return complete;
+}
+
+struct stratum {
+  struct enode **nodes; // A slice of the frontier
+  unsigned long nnodes;
+  int exact; // Read in full; sum is its total
+  unsigned long n;
+  double sum[4];
+  double sumsq; // Of size
+};
+
+int mydu_estimate(const char *root, const struct mydu_opts *opts,
+                  double seconds, unsigned long max_entries,
+                  struct mydu_estimate *est) {
+  struct estimator e;
+  struct stat rootst;
+  if (seconds <= 0 && max_entries == 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (stat(root, &rootst) < 0)
+    return -1;
+  memset(&e, 0, sizeof(e));
+  e.opts = opts;
+  e.root_dev = rootst.st_dev;
+  e.start = est_now();
+  e.seconds = seconds;
+  e.max_entries = max_entries;
+  e.rng = 0x9e3779b97f4a7c15UL; // Fixed, so repeated runs agree
+  e.exclude = exclude_compile(opts->exclude);
+  if (e.exclude == NULL && errno != 0)
+    return -1;
+
+  memset(est, 0, sizeof(*est));
+  int ret = -1;
+  unsigned long nfront = 1, nnext = 0;
+  struct enode **front = malloc(sizeof(struct enode *));
+  struct enode **next = NULL;
+  struct stratum *strata = NULL;
+  double exact[4] = {0, 0, 0, 0};
+  if (front == NULL || (front[0] = enode_new(&e, NULL, root)) == NULL)
+    goto out;
+
+  // Exact levels. A level cut short by the budget leaves its unread
+  // directories in the frontier, next to the children of the read ones.
+  while (nfront > 0 && nfront < EST_STRATA && !est_spent(&e, 0.1)) {
+    unsigned long nread = 0;
+    nnext = 0;
+    for (; nread < nfront && !est_spent(&e, 0.1); nread++) {
+      int fd = enode_open(&e, front[nread]);
+      enode_read(&e, front[nread], fd);
+      if (fd >= 0)
+        close(fd);
+      exact[0] += front[nread]->own.size;
+      exact[1] += front[nread]->own.alloc;
+      exact[2] += front[nread]->own.files;
+      exact[3] += front[nread]->own.dirs;
+      nnext += front[nread]->nkids;
+    }
+    free(next);
+    nnext += nfront - nread;
+    if ((next = malloc((nnext + 1) * sizeof(struct enode *))) == NULL)
+      goto out;
+    nnext = 0;
+    for (unsigned long i = 0; i < nread; i++)
+      for (unsigned long k = 0; k < front[i]->nkids; k++)
+        if ((next[nnext++] = enode_kid(&e, front[i], k)) == NULL)
+          goto out;
+    for (unsigned long i = nread; i < nfront; i++)
+      next[nnext++] = front[i];
+    struct enode **tmp = front;
+    front = next;
+    next = tmp;
+    nfront = nnext;
+  }
+
+  // Strata: random slices of the frontier, at most EST_STRATA of them.
+  for (unsigned long i = nfront; i > 1; i--) {
+    unsigned long j = est_rand(&e) % i;
+    struct enode *tmp = front[i - 1];
+    front[i - 1] = front[j];
+    front[j] = tmp;
+  }
+  unsigned long nstrata = nfront < EST_STRATA ? nfront : EST_STRATA;
+  if ((strata = calloc(nstrata + 1, sizeof(struct stratum))) == NULL)
+    goto out;
+  for (unsigned long i = 0; i < nstrata; i++) {
+    unsigned long first = nfront * i / nstrata;
+    strata[i].nodes = front + first;
+    strata[i].nnodes = nfront * (i + 1) / nstrata - first;
+  }
+
+  // Probes, round robin over the strata, until the budget is spent; at
+  // least EST_MIN_PROBES in all, for a variance.
+  unsigned long sampled = nstrata;
+  int spent = 0;
+  while (sampled > 0 && !spent) {
+    unsigned long before = e.entries;
+    for (unsigned long i = 0; i < nstrata; i++) {
+      double y[4];
+      struct stratum *st = &strata[i];
+      if (st->exact)
+        continue;
+      if (est->probes >= EST_MIN_PROBES && est_spent(&e, 1)) {
+        spent = 1;
+        break;
+      }
+      struct enode *start = st->nodes[est_rand(&e) % st->nnodes];
+      est_probe(&e, start, y);
+      for (int k = 0; k < 4; k++)
+        st->sum[k] += y[k] * st->nnodes;
+      st->sumsq += y[0] * st->nnodes * y[0] * st->nnodes;
+      st->n++;
+      est->probes++;
+    }
+    // Once probes stop finding anything new, small strata may have been
+    // read in full; those need no more sampling.
+    if (e.entries == before) {
+      for (unsigned long i = 0; i < nstrata; i++) {
+        struct stratum *st = &strata[i];
+        double sum[4], total[4] = {0, 0, 0, 0};
+        int complete = !st->exact;
+        for (unsigned long j = 0; complete && j < st->nnodes; j++) {
+          complete = enode_sum(st->nodes[j], sum);
+          for (int k = 0; k < 4; k++)
+            total[k] += sum[k];
+        }
+        if (complete) {
+          memcpy(st->sum, total, sizeof(total));
+          st->exact = 1;
+          st->n = 1;
+          st->sumsq = st->sum[0] * st->sum[0];
+          sampled--;
+        }
+      }
+    }
+  }
+
+  // Short of EST_MIN_PROBES in some stratum, fall back on the ratio
+  // estimate over the strata that were probed at all (or read in full).
+  int cut = 0;
+  for (unsigned long i = 0; i < nstrata; i++)
+    cut |= !strata[i].exact && strata[i].n < EST_MIN_PROBES;
+  double var = 0;
+  if (!cut) {
+    for (unsigned long i = 0; i < nstrata; i++) {
+      struct stratum *st = &strata[i];
+      for (int k = 0; k < 4; k++)
+        exact[k] += st->sum[k] / st->n;
+      double mean = st->sum[0] / st->n;
+      if (!st->exact)
+        var += (st->sumsq - st->n * mean * mean) / (st->n - 1) / st->n;
+    }
+  } else {
+    double ys[4] = {0, 0, 0, 0}, xs = 0;
+    unsigned long m = 0;
+    for (unsigned long i = 0; i < nstrata; i++) {
+      struct stratum *st = &strata[i];
+      if (st->n == 0)
+        continue;
+      for (int k = 0; k < 4; k++)
+        ys[k] += st->sum[k] / st->n;
+      xs += st->nnodes;
+      m++;
+    }
+    for (int k = 0; k < 4; k++)
+      exact[k] += ys[k] / xs * nfront;
+    double ratio = ys[0] / xs, dev = 0;
+    for (unsigned long i = 0; i < nstrata; i++) {
+      struct stratum *st = &strata[i];
+      if (st->n == 0)
+        continue;
+      double d = st->sum[0] / st->n - ratio * st->nnodes;
+      dev += d * d;
+    }
+    if (m > 1)
+      var = (double)nstrata * nstrata / m * dev / (m - 1);
+  }
+  est->size = exact[0];
+  est->alloc = exact[1];
+  est->files = exact[2];
+  est->dirs = exact[3];
+  est->size_ci = 1.96 * est_sqrt(var);
+  est->strata = nstrata;
+  est->entries = e.entries;
+  est->exact = sampled == 0 && e.links_skipped == 0;
+  ret = 0;
+
+out:
+  if (ret < 0)
+    errno = ENOMEM;
+  free(front);
+  free(next);
+  free(strata);
+  while (e.nodes != NULL) {
+    struct enode *n = e.nodes;
+    e.nodes = n->next;
+    batch_free(n->batch);
+    free(n->kid_ent);
+    free(n->kids);
+    free(n);
+  }
+  free(e.chain);
+  free(e.path);
+  free(e.exclude);
+  return ret;
+}
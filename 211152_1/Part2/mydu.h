@@ -0,0 +1,122 @@
+#ifndef MYDU_H
+#define MYDU_H
+
+/*
+ * libmydu: the myDU traversal as a library.
+ *
+ *   gcc -O2 -c mydu.c && ar rcs libmydu.a mydu.o
+ *   gcc -O2 -o agent agent.c libmydu.a -lpthread
+ *
+ * mydu_scan() walks a tree and sums apparent sizes the way myDU does: every
+ * directory inode and regular file counts, and symlinks are followed unless
+ * follow_symlinks is cleared. Callbacks see every file and every directory as
+ * its subtree completes; with more than one thread they run concurrently on
+ * the worker threads and must be thread-safe. A directory reached again
+ * through another symlink is summed from memory; without on_file it is
+ * reported as a single on_dir entry rather than walked again.
+ */
+
+/*
+ * What a scan adds up. Every figure comes from the one stat each entry gets
+ * anyway; hardlinked files count at every name.
+ */
+struct mydu_usage {
+  unsigned long size;  // Apparent bytes (st_size)
+  unsigned long alloc; // Allocated bytes (st_blocks * 512)
+  unsigned long files; // Regular files
+  unsigned long dirs;  // Directories, including the one reported
+};
+
+// mydu_entry.flags
+#define MYDU_LINKED 1     // Reached through a followed symlink
+#define MYDU_ERROR 2      // Some entry of this directory could not be read
+#define MYDU_INCOMPLETE 4 // MYDU_ERROR here or below; the total is short
+
+struct mydu_entry {
+  const char *path;    // Full path, valid only during the callback
+  unsigned long size;  // File size, or the directory's subtree total
+  unsigned long depth; // 0 for the scan root
+  int flags;
+  const struct mydu_usage *usage; // The same, in full; size == usage->size
+};
+
+/*
+ * Traversal counters. Each thread counts into a block of its own and adds it
+ * to the caller's every 4096 entries and when it finishes, so another
+ * thread can read the fields with relaxed atomic loads for a progress report
+ * while the scan runs. The times are wall-clock nanoseconds spent inside
+ * each class of syscall, summed over the threads.
+ */
+struct mydu_stats {
+  unsigned long dirs;    // Directories opened
+  unsigned long entries; // Directory entries read
+  unsigned long stats;   // stat calls
+  unsigned long bytes;   // Apparent bytes summed so far
+  unsigned long errors;  // Entries that could not be read
+  unsigned long open_ns; // open, fdopendir and closedir
+  unsigned long read_ns; // readdir
+  unsigned long stat_ns; // stat
+};
+
+// Return non-zero to cancel the scan.
+typedef int (*mydu_entry_fn)(const struct mydu_entry *entry, void *arg);
+
+struct mydu_opts {
+  int follow_symlinks; // Count what links point to (default 1)
+  int one_filesystem;  // Do not descend into other filesystems
+  int threads;         // Worker threads; 0 for one per CPU (default)
+  int inode_order;     // Stat each directory's entries in d_ino order
+  int keep_going;      // Skip unreadable entries, flagging their directory
+  const char *cache_path; // Persistent directory size cache, or NULL
+  // NULL-terminated glob patterns; matching entries and their subtrees are
+  // skipped without being stat-ed. A pattern containing '/' is matched
+  // against the full path, others against the name. The cache is not used
+  // when any are given.
+  const char *const *exclude;
+  mydu_entry_fn on_file;
+  mydu_entry_fn on_dir;
+  void *arg;                // Passed to the callbacks
+  volatile int *cancel;     // Scan stops soon after *cancel becomes non-zero
+  struct mydu_stats *stats; // Counters to add to, or NULL
+};
+
+void mydu_opts_init(struct mydu_opts *opts);
+
+/*
+ * Scan root and store its total in *total. Returns 0 on success, or -1 with
+ * errno set: ECANCELED if cancelled, otherwise the error of the first entry
+ * that could not be read. With keep_going only the root itself and running
+ * out of memory are fatal; other errors show up in the entry flags.
+ */
+int mydu_scan(const char *root, const struct mydu_opts *opts,
+              unsigned long *total);
+
+// As mydu_scan(), reporting every metric of the root.
+int mydu_scan_usage(const char *root, const struct mydu_opts *opts,
+                    struct mydu_usage *total);
+
+/*
+ * Estimate root's usage by sampling instead of walking everything: roughly
+ * seconds of wall time and/or max_entries directory entries read (0 for
+ * no limit, but at least one is required). Honours follow_symlinks (links
+ * to directories are never followed), one_filesystem and exclude; threads,
+ * the cache, callbacks and stats are not used. Returns 0, or -1 with errno
+ * set.
+ */
+struct mydu_estimate {
+  double size; // Estimated totals, as in struct mydu_usage
+  double alloc;
+  double files;
+  double dirs;
+  double size_ci;        // Half-width of the 95% confidence interval
+  unsigned long strata;  // Subtrees sampled separately
+  unsigned long probes;  // Root-to-leaf samples taken
+  unsigned long entries; // Directory entries read
+  int exact; // Read in full, no directory link left out; size_ci is 0
+};
+
+int mydu_estimate(const char *root, const struct mydu_opts *opts,
+                  double seconds, unsigned long max_entries,
+                  struct mydu_estimate *est);
+
+#endif